@@ -0,0 +1,225 @@
+#ifndef COMMAND_CHANNEL_H
+#define COMMAND_CHANNEL_H
+
+#include <cstdio>
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "net.h"
+
+#ifdef _WIN32
+#include <io.h>
+#endif
+
+// Line based channel for batches of retro shell commands, read from stdin or a loopback TCP port (one client at
+// a time). A batch is ended by an empty line (or end of input), lines starting with '#' are ignored. Replies are
+// written back one line at a time. With commands on stdin, stdout only carries the replies.
+class command_channel {
+public:
+    // Sends everything but the replies written to stdout (by the emulator and SDL as well) to stderr
+    static void reserve_stdout()
+    {
+        if (replies_)
+            return;
+        fflush(stdout);
+#ifdef _WIN32
+        const int fd = _dup(_fileno(stdout));
+        replies_ = fd < 0 ? nullptr : _fdopen(fd, "w");
+        if (replies_)
+            _dup2(_fileno(stderr), _fileno(stdout));
+#else
+        const int fd = dup(STDOUT_FILENO);
+        replies_ = fd < 0 ? nullptr : fdopen(fd, "w");
+        if (replies_)
+            dup2(STDERR_FILENO, STDOUT_FILENO);
+#endif
+        if (!replies_)
+            throw std::runtime_error("Can't reserve stdout for command replies");
+    }
+
+    static std::unique_ptr<command_channel> from_stdin()
+    {
+        reserve_stdout();
+        std::unique_ptr<command_channel> c { new command_channel };
+        // std::getline can't be interrupted, so the reader is detached and simply ends with the process
+        std::thread { [ch = c.get()]() {
+            for (std::string line; std::getline(std::cin, line);)
+                ch->push_line(line);
+            ch->push_line("");
+        } }.detach();
+        return c;
+    }
+
+    static std::unique_ptr<command_channel> tcp(uint16_t port)
+    {
+        std::unique_ptr<command_channel> c { new command_channel };
+        c->listener_ = tcp_socket::listen(port);
+        std::cout << "Accepting commands on 127.0.0.1:" << port << "\n";
+        return c;
+    }
+
+    command_channel(const command_channel&) = delete;
+    command_channel& operator=(const command_channel&) = delete;
+
+    // Called whenever a batch is complete, possibly from the stdin reader thread
+    void on_batch(std::function<void()> f)
+    {
+        std::lock_guard<std::mutex> lock { mutex_ };
+        on_batch_ = std::move(f);
+    }
+
+    // Socket input only arrives through pump(), so it has to be called regularly
+    bool polled() const
+    {
+        return static_cast<bool>(listener_);
+    }
+
+    bool has_output() const
+    {
+        return !out_.empty();
+    }
+
+    // Returns false if there's no complete batch yet
+    bool next_batch(std::vector<std::string>& batch)
+    {
+        std::lock_guard<std::mutex> lock { mutex_ };
+        if (batches_.empty())
+            return false;
+        batch = std::move(batches_.front());
+        batches_.pop_front();
+        return true;
+    }
+
+    void reply(const std::string& line)
+    {
+        if (listener_) {
+            if (client_)
+                out_ += line + "\n";
+        } else {
+            fprintf(replies_, "%s\n", line.c_str());
+            fflush(replies_);
+        }
+    }
+
+    // Non-blocking socket I/O
+    void pump()
+    {
+        if (!listener_)
+            return;
+        if (!client_) {
+            client_ = listener_.accept();
+            if (!client_)
+                return;
+            std::cout << "Command channel: client connected\n";
+        }
+
+        char buf[4096];
+        for (ptrdiff_t n; (n = client_.recv(buf, sizeof(buf))) != 0;) {
+            if (n < 0) {
+                disconnect();
+                return;
+            }
+            in_.append(buf, n);
+        }
+        for (size_t pos; (pos = in_.find('\n')) != std::string::npos;) {
+            std::string line = in_.substr(0, pos);
+            if (!line.empty() && line.back() == '\r')
+                line.pop_back();
+            in_.erase(0, pos + 1);
+            push_line(line);
+        }
+
+        while (!out_.empty()) {
+            const ptrdiff_t n = client_.send(out_.data(), out_.size());
+            if (n < 0) {
+                disconnect();
+                return;
+            }
+            if (!n)
+                break;
+            out_.erase(0, n);
+        }
+    }
+
+private:
+    command_channel() = default;
+
+    inline static FILE* replies_ = nullptr;
+    net_init net_init_;
+    tcp_socket listener_;
+    tcp_socket client_;
+    std::string in_;
+    std::string out_;
+    std::mutex mutex_;
+    std::vector<std::string> current_;
+    std::deque<std::vector<std::string>> batches_;
+    std::function<void()> on_batch_;
+
+    void push_line(const std::string& line)
+    {
+        std::lock_guard<std::mutex> lock { mutex_ };
+        if (line.find_first_not_of(" \t") == std::string::npos) {
+            if (!current_.empty()) {
+                batches_.push_back(std::move(current_));
+                if (on_batch_)
+                    on_batch_();
+            }
+            current_.clear();
+        } else if (line[0] != '#') {
+            current_.push_back(line);
+        }
+    }
+
+    void disconnect()
+    {
+        std::cout << "Command channel: client disconnected\n";
+        client_.close();
+        in_.clear();
+        out_.clear();
+        // A partial batch from a client that went away isn't run
+        std::lock_guard<std::mutex> lock { mutex_ };
+        current_.clear();
+    }
+};
+
+inline std::string json_string(const std::string& s)
+{
+    std::string res { "\"" };
+    for (const char c : s) {
+        switch (c) {
+        case '"':
+            res += "\\\"";
+            break;
+        case '\\':
+            res += "\\\\";
+            break;
+        case '\n':
+            res += "\\n";
+            break;
+        case '\r':
+            res += "\\r";
+            break;
+        case '\t':
+            res += "\\t";
+            break;
+        default:
+            if (static_cast<unsigned char>(c) < 0x20) {
+                char buf[8];
+                snprintf(buf, sizeof(buf), "\\u%04x", c);
+                res += buf;
+            } else {
+                res += c;
+            }
+        }
+    }
+    return res + "\"";
+}
+
+#endif
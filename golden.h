@@ -0,0 +1,381 @@
+#ifndef GOLDEN_H
+#define GOLDEN_H
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+// XXH64 (https://github.com/Cyan4973/xxHash), assumes a little endian host
+inline uint64_t xxh64(const void* data, size_t len, uint64_t seed = 0)
+{
+    constexpr uint64_t p1 = 11400714785074694791ULL;
+    constexpr uint64_t p2 = 14029467366897019727ULL;
+    constexpr uint64_t p3 = 1609587929392839161ULL;
+    constexpr uint64_t p4 = 9650029242287828579ULL;
+    constexpr uint64_t p5 = 2870177450012600261ULL;
+
+    const auto rotl = [](uint64_t x, int r) { return (x << r) | (x >> (64 - r)); };
+    const auto read64 = [](const uint8_t* p) { uint64_t v; std::memcpy(&v, p, sizeof(v)); return v; };
+    const auto read32 = [](const uint8_t* p) { uint32_t v; std::memcpy(&v, p, sizeof(v)); return v; };
+    const auto round = [&](uint64_t acc, uint64_t input) { return rotl(acc + input * p2, 31) * p1; };
+    const auto merge = [&](uint64_t acc, uint64_t v) { return (acc ^ round(0, v)) * p1 + p4; };
+
+    const uint8_t* p = static_cast<const uint8_t*>(data);
+    const uint8_t* const end = p + len;
+    uint64_t h;
+
+    if (len >= 32) {
+        uint64_t v1 = seed + p1 + p2;
+        uint64_t v2 = seed + p2;
+        uint64_t v3 = seed;
+        uint64_t v4 = seed - p1;
+        do {
+            v1 = round(v1, read64(p));
+            v2 = round(v2, read64(p + 8));
+            v3 = round(v3, read64(p + 16));
+            v4 = round(v4, read64(p + 24));
+            p += 32;
+        } while (end - p >= 32);
+        h = rotl(v1, 1) + rotl(v2, 7) + rotl(v3, 12) + rotl(v4, 18);
+        h = merge(h, v1);
+        h = merge(h, v2);
+        h = merge(h, v3);
+        h = merge(h, v4);
+    } else {
+        h = seed + p5;
+    }
+
+    h += len;
+    for (; end - p >= 8; p += 8)
+        h = rotl(h ^ round(0, read64(p)), 27) * p1 + p4;
+    if (end - p >= 4) {
+        h = rotl(h ^ (read32(p) * p1), 23) * p2 + p3;
+        p += 4;
+    }
+    for (; p < end; ++p)
+        h = rotl(h ^ (*p * p5), 11) * p1;
+
+    h ^= h >> 33;
+    h *= p2;
+    h ^= h >> 29;
+    h *= p3;
+    h ^= h >> 32;
+    return h;
+}
+
+// Writes 32-bit RGBA32 (byte order) pixels as an uncompressed 24-bit PNG
+inline void write_png(const std::string& filename, const uint32_t* pixels, int width, int height)
+{
+    static const auto crc_table = [] {
+        std::vector<uint32_t> t(256);
+        for (uint32_t n = 0; n < 256; ++n) {
+            uint32_t c = n;
+            for (int k = 0; k < 8; ++k)
+                c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+            t[n] = c;
+        }
+        return t;
+    }();
+
+    std::ofstream out { filename, std::ios::binary };
+    if (!out)
+        throw std::runtime_error { "Error creating " + filename };
+
+    const auto put32 = [](std::string& s, uint32_t v) {
+        for (int i = 24; i >= 0; i -= 8)
+            s.push_back(static_cast<char>(v >> i));
+    };
+    const auto chunk = [&](const char* type, const std::string& data) {
+        std::string c;
+        put32(c, static_cast<uint32_t>(data.size()));
+        c += type;
+        c += data;
+        uint32_t crc = 0xffffffff;
+        for (size_t i = 4; i < c.size(); ++i)
+            crc = crc_table[(crc ^ static_cast<uint8_t>(c[i])) & 0xff] ^ (crc >> 8);
+        put32(c, ~crc);
+        out.write(c.data(), c.size());
+    };
+
+    std::string raw;
+    raw.reserve(static_cast<size_t>(height) * (1 + width * 3));
+    for (int y = 0; y < height; ++y) {
+        raw.push_back(0); // No filter
+        for (int x = 0; x < width; ++x) {
+            const uint32_t c = pixels[y * width + x];
+            raw.push_back(static_cast<char>(c));
+            raw.push_back(static_cast<char>(c >> 8));
+            raw.push_back(static_cast<char>(c >> 16));
+        }
+    }
+
+    // zlib stream using stored (uncompressed) deflate blocks
+    std::string z { "\x78\x01", 2 };
+    for (size_t pos = 0; pos < raw.size() || pos == 0;) {
+        const size_t len = std::min<size_t>(raw.size() - pos, 65535);
+        z.push_back(pos + len == raw.size() ? 1 : 0);
+        z.push_back(static_cast<char>(len));
+        z.push_back(static_cast<char>(len >> 8));
+        z.push_back(static_cast<char>(~len));
+        z.push_back(static_cast<char>(~len >> 8));
+        z.append(raw, pos, len);
+        pos += len;
+        if (!len)
+            break;
+    }
+    uint32_t a = 1, b = 0;
+    for (const char c : raw) {
+        a = (a + static_cast<uint8_t>(c)) % 65521;
+        b = (b + a) % 65521;
+    }
+    put32(z, b << 16 | a);
+
+    std::string ihdr;
+    put32(ihdr, width);
+    put32(ihdr, height);
+    ihdr += std::string { "\x08\x02\x00\x00\x00", 5 }; // 8-bit RGB
+
+    out.write("\x89PNG\r\n\x1a\n", 8);
+    chunk("IHDR", ihdr);
+    chunk("IDAT", z);
+    chunk("IEND", "");
+}
+
+// Golden frame testing: hashes the visible area at selected emulated frames on a worker thread and either
+// records the hashes or compares them against a golden file (dumping a PNG for each mismatch).
+//
+// Golden file format, one check per line: "<frame> <xxh64 hex>". '#' starts a comment.
+class golden_checker {
+public:
+    // Compare against an existing golden file
+    static std::unique_ptr<golden_checker> verify(const std::string& filename)
+    {
+        std::ifstream in { filename };
+        if (!in)
+            throw std::runtime_error { "Error opening golden file: " + filename };
+        std::unique_ptr<golden_checker> g { new golden_checker { filename, false } };
+        for (std::string line; std::getline(in, line);) {
+            if (const auto pos = line.find('#'); pos != std::string::npos)
+                line.erase(pos);
+            std::istringstream iss { line };
+            uint32_t frame;
+            std::string hash;
+            if (!(iss >> frame))
+                continue;
+            if (!(iss >> hash))
+                throw std::runtime_error { "Invalid line in " + filename + ": " + line };
+            g->expected_[frame] = std::stoull(hash, nullptr, 16);
+            g->frames_.insert(frame);
+        }
+        if (g->frames_.empty())
+            throw std::runtime_error { "No frames in golden file: " + filename };
+        return g;
+    }
+
+    // Record hashes for the given frames, written to filename by finish()
+    static std::unique_ptr<golden_checker> record(const std::string& filename, const std::set<uint32_t>& frames)
+    {
+        if (frames.empty())
+            throw std::runtime_error { "No frames to record (use -golden-frames)" };
+        std::unique_ptr<golden_checker> g { new golden_checker { filename, true } };
+        g->frames_ = frames;
+        return g;
+    }
+
+    // Parses a comma separated list of frames and "first-last[/step]" ranges
+    static std::set<uint32_t> parse_frames(const std::string& spec)
+    {
+        std::set<uint32_t> frames;
+        std::istringstream iss { spec };
+        for (std::string item; std::getline(iss, item, ',');) {
+            uint32_t first, last, step = 1;
+            char dash, slash;
+            std::istringstream is { item };
+            if (!(is >> first))
+                throw std::runtime_error { "Invalid frame specification: " + item };
+            last = first;
+            if (is >> dash && (dash != '-' || !(is >> last) || (is >> slash && (slash != '/' || !(is >> step) || !step))))
+                throw std::runtime_error { "Invalid frame specification: " + item };
+            for (uint32_t f = first; f <= last; f += step) {
+                frames.insert(f);
+                if (last - f < step)
+                    break; // f + step would wrap around
+            }
+        }
+        return frames;
+    }
+
+    golden_checker(const golden_checker&) = delete;
+    golden_checker& operator=(const golden_checker&) = delete;
+
+    ~golden_checker()
+    {
+        stop();
+    }
+
+    bool wants(uint32_t frame) const
+    {
+        return frames_.count(frame) != 0;
+    }
+
+    // Queue a copy of the visible area (width x height RGBA32 pixels, given stride) for checking
+    void submit(uint32_t frame, const uint32_t* src, int width, int height, int stride)
+    {
+        std::unique_lock<std::mutex> lock { mutex_ };
+        // Only stalls the caller if the worker is hopelessly behind
+        idle_.wait(lock, [this] { return queue_.size() < max_pending; });
+        std::vector<uint32_t> buf;
+        if (!free_.empty()) {
+            buf = std::move(free_.back());
+            free_.pop_back();
+        }
+        lock.unlock();
+
+        buf.resize(static_cast<size_t>(width) * height);
+        for (int y = 0; y < height; ++y)
+            std::memcpy(&buf[static_cast<size_t>(y) * width], src + static_cast<size_t>(y) * stride, width * sizeof(uint32_t));
+
+        lock.lock();
+        queue_.push_back({ frame, width, height, std::move(buf) });
+        seen_.insert(frame);
+        lock.unlock();
+        work_.notify_one();
+    }
+
+    // True once the emulation has passed the last frame of interest
+    bool done(uint32_t current_frame) const
+    {
+        return current_frame >= *frames_.rbegin();
+    }
+
+    // Waits for pending checks, prints a summary and returns the exit code
+    int finish()
+    {
+        stop();
+        for (const auto& e : errors_)
+            std::cerr << "Golden: " << e << "\n";
+        size_t missed = 0;
+        for (const auto f : frames_) {
+            if (!seen_.count(f)) {
+                std::cerr << "Golden: frame " << f << " was never seen (skipped by the frontend?)\n";
+                ++missed;
+            }
+        }
+        if (recording_) {
+            std::ofstream out { filename_ };
+            if (!out)
+                throw std::runtime_error { "Error creating " + filename_ };
+            for (const auto& [frame, hash] : actual_) {
+                char buf[64];
+                snprintf(buf, sizeof(buf), "%u %016llx\n", frame, static_cast<unsigned long long>(hash));
+                out << buf;
+            }
+            std::cout << "Golden: recorded " << actual_.size() << " frame hashes to " << filename_ << "\n";
+            return missed || !errors_.empty() ? 1 : 0;
+        }
+        std::cout << "Golden: " << actual_.size() - mismatches_ << " passed, " << mismatches_ << " failed, " << missed << " missed, " << errors_.size() << " errors\n";
+        return mismatches_ || missed || !errors_.empty() ? 1 : 0;
+    }
+
+private:
+    struct job {
+        uint32_t frame;
+        int width;
+        int height;
+        std::vector<uint32_t> pixels;
+    };
+
+    static constexpr size_t max_pending = 64;
+
+    const std::string filename_;
+    const bool recording_;
+    std::set<uint32_t> frames_;
+    std::set<uint32_t> seen_;
+    std::map<uint32_t, uint64_t> expected_;
+    std::map<uint32_t, uint64_t> actual_; // Only touched by the worker until it's stopped
+    size_t mismatches_ = 0;
+    std::vector<std::string> errors_; // Like actual_
+
+    std::mutex mutex_;
+    std::condition_variable work_;
+    std::condition_variable idle_;
+    std::deque<job> queue_;
+    std::vector<std::vector<uint32_t>> free_;
+    bool quit_ = false;
+    std::thread worker_;
+
+    golden_checker(const std::string& filename, bool recording)
+        : filename_ { filename }
+        , recording_ { recording }
+        , worker_ { [this] { run(); } }
+    {
+    }
+
+    void stop()
+    {
+        if (!worker_.joinable())
+            return;
+        {
+            std::lock_guard<std::mutex> lock { mutex_ };
+            quit_ = true;
+        }
+        work_.notify_one();
+        worker_.join();
+    }
+
+    void run()
+    {
+        std::unique_lock<std::mutex> lock { mutex_ };
+        for (;;) {
+            work_.wait(lock, [this] { return quit_ || !queue_.empty(); });
+            if (queue_.empty())
+                return; // Only quit once everything has been checked
+            job j = std::move(queue_.front());
+            queue_.pop_front();
+            lock.unlock();
+
+            try {
+                check(j);
+            } catch (const std::exception& e) {
+                errors_.push_back("frame " + std::to_string(j.frame) + ": " + e.what());
+            }
+
+            lock.lock();
+            free_.push_back(std::move(j.pixels));
+            idle_.notify_one();
+        }
+    }
+
+    void check(const job& j)
+    {
+        const uint64_t hash = xxh64(j.pixels.data(), j.pixels.size() * sizeof(uint32_t));
+        actual_[j.frame] = hash;
+        if (recording_)
+            return;
+        const uint64_t expected = expected_.at(j.frame);
+        if (hash == expected)
+            return;
+        ++mismatches_;
+        const std::string png = "golden_" + std::to_string(j.frame) + ".png";
+        char buf[128];
+        snprintf(buf, sizeof(buf), "Golden: frame %u mismatch, expected %016llx got %016llx, see ", j.frame, static_cast<unsigned long long>(expected), static_cast<unsigned long long>(hash));
+        std::cerr << buf << png << "\n";
+        write_png(png, j.pixels.data(), j.width, j.height);
+    }
+};
+
+#endif
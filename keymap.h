@@ -0,0 +1,156 @@
+#ifndef KEYMAP_H
+#define KEYMAP_H
+
+#include <cstdint>
+
+#include <SDL.h>
+
+// SDL keycode to Amiga raw keycode, 0xFF if there's no mapping
+inline uint8_t convert_key(SDL_Keycode key)
+{
+    switch (key) {
+    case SDLK_RETURN: return 0x44;
+    case SDLK_ESCAPE: return 0x45;
+    case SDLK_BACKSPACE: return 0x41;
+    case SDLK_TAB: return 0x42;
+    case SDLK_SPACE: return 0x40;
+    case SDLK_QUOTE: return 0x2A;
+    case SDLK_COMMA: return 0x38;
+    case SDLK_MINUS: return 0x0B;
+    case SDLK_PERIOD: return 0x39;
+    case SDLK_SLASH: return 0x3A;
+    case SDLK_0: return 0x0A;
+    case SDLK_1: return 0x01;
+    case SDLK_2: return 0x02;
+    case SDLK_3: return 0x03;
+    case SDLK_4: return 0x04;
+    case SDLK_5: return 0x05;
+    case SDLK_6: return 0x06;
+    case SDLK_7: return 0x07;
+    case SDLK_8: return 0x08;
+    case SDLK_9: return 0x09;
+    case SDLK_SEMICOLON: return 0x29;
+    case SDLK_EQUALS: return 0x0C;
+    case SDLK_LEFTBRACKET: return 0x1A;
+    case SDLK_BACKSLASH: return 0x0D;
+    case SDLK_RIGHTBRACKET: return 0x1B;
+    case SDLK_BACKQUOTE: return 0x00;
+    case SDLK_a: return 0x20;
+    case SDLK_b: return 0x35;
+    case SDLK_c: return 0x33;
+    case SDLK_d: return 0x22;
+    case SDLK_e: return 0x12;
+    case SDLK_f: return 0x23;
+    case SDLK_g: return 0x24;
+    case SDLK_h: return 0x25;
+    case SDLK_i: return 0x17;
+    case SDLK_j: return 0x26;
+    case SDLK_k: return 0x27;
+    case SDLK_l: return 0x28;
+    case SDLK_m: return 0x37;
+    case SDLK_n: return 0x36;
+    case SDLK_o: return 0x18;
+    case SDLK_p: return 0x19;
+    case SDLK_q: return 0x10;
+    case SDLK_r: return 0x13;
+    case SDLK_s: return 0x21;
+    case SDLK_t: return 0x14;
+    case SDLK_u: return 0x16;
+    case SDLK_v: return 0x34;
+    case SDLK_w: return 0x11;
+    case SDLK_x: return 0x32;
+    case SDLK_y: return 0x15;
+    case SDLK_z: return 0x31;
+    //case SDLK_CAPSLOCK: return 0x62;
+    case SDLK_F1: return 0x50;
+    case SDLK_F2: return 0x51;
+    case SDLK_F3: return 0x52;
+    case SDLK_F4: return 0x53;
+    case SDLK_F5: return 0x54;
+    case SDLK_F6: return 0x55;
+    case SDLK_F7: return 0x56;
+    case SDLK_F8: return 0x57;
+    case SDLK_F9: return 0x58;
+    case SDLK_F10: return 0x59;
+    case SDLK_INSERT: return 0x66; // Left amiga
+    case SDLK_HOME: return 0x67; // Right amiga
+    //case SDLK_PAGEUP: return 0xFF;
+    case SDLK_DELETE: return 0x46;
+    //case SDLK_END: return 0xFF;
+    case SDLK_PAGEDOWN: return 0x5F; // Help
+    case SDLK_RIGHT: return 0x4E;
+    case SDLK_LEFT: return 0x4F;
+    case SDLK_DOWN: return 0x4D;
+    case SDLK_UP: return 0x4C;
+    case SDLK_LCTRL: return 0x63;
+    case SDLK_LSHIFT: return 0x60;
+    case SDLK_LALT: return 0x64;
+    //case SDLK_LGUI: return 0xFF;
+    //case SDLK_RCTRL: return 0xFF;
+    case SDLK_RSHIFT: return 0x61;
+    case SDLK_RALT: return 0x65;
+    //case SDLK_RGUI: return 0xFF;
+    }
+    return 0xFF;
+}
+
+inline char with_shift(char c)
+{
+    switch (c) {
+    case '1': return '!';
+    case '2': return '@';
+    case '3': return '#';
+    case '4': return '$';
+    case '5': return '%';
+    case '6': return '^';
+    case '7': return '&';
+    case '8': return '*';
+    case '9': return '(';
+    case '0': return ')';
+    case '-': return '_';
+    case '=': return '+';
+    case '\\': return '|';
+    case ',': return '<';
+    case '.': return '>';
+    case '/': return '?';
+    case '[': return '{';
+    case ']': return '}';
+    case ';': return ':';
+    case '\'': return '"';
+    case '`': return '~';
+    }
+    return c;
+}
+
+constexpr uint8_t amiga_key_left_shift = 0x60;
+constexpr uint8_t amiga_key_return = 0x44;
+
+// Amiga keycode for typing c, and whether shift must be held. Returns false if no key produces c.
+inline bool char_to_key(char c, uint8_t& key, bool& shift)
+{
+    shift = false;
+    if (c == '\n') {
+        key = amiga_key_return;
+        return true;
+    } else if (c == '\t') {
+        key = convert_key(SDLK_TAB);
+        return true;
+    } else if (c >= 'A' && c <= 'Z') {
+        key = convert_key(SDLK_a + (c - 'A'));
+        shift = true;
+        return true;
+    }
+    for (char k = ' '; k < 0x7f; ++k) {
+        const uint8_t code = convert_key(k);
+        if (code == 0xFF)
+            continue;
+        if (k == c || (with_shift(k) == c && with_shift(k) != k)) {
+            key = code;
+            shift = k != c;
+            return true;
+        }
+    }
+    return false;
+}
+
+#endif
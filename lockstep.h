@@ -0,0 +1,158 @@
+#ifndef LOCKSTEP_H
+#define LOCKSTEP_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <iostream>
+#include <map>
+#include <vector>
+
+#include "golden.h"
+
+// Compares per frame picture hashes of several instances running the same workload. Frames are
+// checked once every instance has submitted them; a frame some instance went past unseen is dropped once all
+// of them are past it, and counted. A divergence found after such a gap may have started in it, which the
+// report says. Audio is compared as a running hash of every sample taken from each instance.
+class lockstep_checker {
+public:
+    explicit lockstep_checker(int instances)
+        : latest_(instances, 0)
+        , audio_(instances, 0)
+    {
+    }
+
+    // Hash of a field (width x height pixels, lines stride pixels apart)
+    static uint64_t hash_frame(const uint32_t* src, int width, int height, int stride)
+    {
+        uint64_t h = 0;
+        for (int y = 0; y < height; ++y)
+            h = xxh64(src + static_cast<size_t>(y) * stride, width * sizeof(uint32_t), h);
+        return h;
+    }
+
+    void submit(int instance, uint32_t frame, uint64_t video)
+    {
+        const int n = static_cast<int>(latest_.size());
+        auto& e = pending_[frame];
+        if (e.video.empty()) {
+            e.video.resize(n);
+            e.have.resize(n);
+        }
+        if (e.have[instance])
+            return;
+        e.have[instance] = true;
+        e.video[instance] = video;
+
+        // Before checking, so a gap right before this frame is known
+        latest_[instance] = std::max(latest_[instance], frame);
+        const uint32_t oldest = *std::min_element(latest_.begin(), latest_.end());
+        for (auto it = pending_.begin(); it != pending_.end() && it->first < oldest && it->first != frame;) {
+            ++unchecked_;
+            last_unchecked_ = std::max(last_unchecked_, it->first);
+            it = pending_.erase(it);
+        }
+
+        if (++e.count == n) {
+            check(frame, e);
+            pending_.erase(frame);
+        }
+    }
+
+    void submit_audio(int instance, const float* samples, size_t count)
+    {
+        audio_[instance] = xxh64(samples, count * sizeof(float), audio_[instance]);
+    }
+
+    // All instances have submitted their samples up to the end of frame
+    void check_audio(uint32_t frame)
+    {
+        if (audio_diverged_)
+            return;
+        for (size_t i = 1; i < audio_.size(); ++i) {
+            if (audio_[i] == audio_[0])
+                continue;
+            audio_diverged_ = true;
+            audio_divergence_ = frame;
+            std::cerr << "Lockstep: audio diverged between frames " << audio_checked_ << " and " << frame << ", instance " << i + 1 << "\n";
+            return;
+        }
+        audio_checked_ = frame;
+    }
+
+    bool diverged() const
+    {
+        return diverged_ || audio_diverged_;
+    }
+
+    uint64_t checked() const
+    {
+        return checked_;
+    }
+
+    // Prints the summary, returns the exit code
+    int finish() const
+    {
+        std::cout << "Lockstep: " << checked_ << " frames compared, " << unchecked_ << " skipped";
+        if (!diverged_) {
+            std::cout << ", no divergence";
+        } else {
+            std::cout << ", diverged at frame " << divergence_;
+            if (divergence_after_ + 1 < divergence_)
+                std::cout << " (or earlier, after frame " << divergence_after_ << ")";
+        }
+        if (!audio_diverged_)
+            std::cout << "; audio matches up to frame " << audio_checked_ << "\n";
+        else
+            std::cout << "; audio diverged between frames " << audio_checked_ << " and " << audio_divergence_ << "\n";
+        return diverged() ? 1 : 0;
+    }
+
+private:
+    struct entry {
+        std::vector<uint64_t> video;
+        std::vector<bool> have;
+        int count = 0;
+    };
+
+    std::vector<uint32_t> latest_;
+    std::map<uint32_t, entry> pending_;
+    uint64_t checked_ = 0;
+    uint64_t unchecked_ = 0;
+    uint32_t last_match_ = 0;
+    uint32_t last_unchecked_ = 0;
+    bool diverged_ = false;
+    uint32_t divergence_ = 0;
+    uint32_t divergence_after_ = 0; // The divergence happened after this frame
+    std::vector<uint64_t> audio_;
+    uint32_t audio_checked_ = 0; // Last frame the audio matched at
+    bool audio_diverged_ = false;
+    uint32_t audio_divergence_ = 0;
+
+    void check(uint32_t frame, const entry& e)
+    {
+        ++checked_;
+        if (diverged_)
+            return;
+        for (size_t i = 1; i < e.video.size(); ++i) {
+            if (e.video[i] == e.video[0])
+                continue;
+            diverged_ = true;
+            divergence_ = frame;
+            // Only frames between the last match and this one that weren't compared leave any doubt
+            divergence_after_ = last_unchecked_ > last_match_ && last_unchecked_ < frame ? last_match_ : frame - 1;
+            char buf[256];
+            snprintf(buf, sizeof(buf), "Lockstep: first divergence at frame %u, instance 1: %016llx instance %zu: %016llx", frame, static_cast<unsigned long long>(e.video[0]), i + 1, static_cast<unsigned long long>(e.video[i]));
+            std::cerr << buf;
+            if (divergence_after_ + 2 == frame)
+                std::cerr << " (frame " << frame - 1 << " wasn't compared, it may have started there)";
+            else if (divergence_after_ + 1 < frame)
+                std::cerr << " (frames " << divergence_after_ + 1 << "-" << frame - 1 << " weren't all compared, it may have started there)";
+            std::cerr << "\n";
+            return;
+        }
+        last_match_ = std::max(last_match_, frame);
+    }
+};
+
+#endif
@@ -1,4 +1,10 @@
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <mutex>
 #include <iostream>
+#include <limits>
 #include <stdexcept>
 #include <memory>
 #include <string>
@@ -23,7 +29,14 @@
 #include "Snapshot.h"
 #include "VAmiga.h"
 
+#include "keymap.h"
 #include "microknight.h"
+#include "profiler.h"
+#include "serial_bridge.h"
+#include "golden.h"
+#include "stream.h"
+#include "command_channel.h"
+#include "lockstep.h"
 
 using namespace vamiga;
 
@@ -72,6 +85,7 @@ using type##_ptr = std::unique_ptr<type, type##_destroyer>
 MAKE_SDL_PTR(SDL_Window, SDL_DestroyWindow);
 MAKE_SDL_PTR(SDL_Renderer, SDL_DestroyRenderer);
 MAKE_SDL_PTR(SDL_Texture, SDL_DestroyTexture);
+MAKE_SDL_PTR(SDL_GameController, SDL_GameControllerClose);
 
 struct sdl_freer {
     void operator()(void* ptr) const {
@@ -79,119 +93,13 @@ struct sdl_freer {
     }
 };
 
-uint8_t convert_key(SDL_Keycode key)
+std::string timestamped_filename(const char* prefix, const char* extension)
 {
-    switch (key) {
-    case SDLK_RETURN: return 0x44;
-    case SDLK_ESCAPE: return 0x45;
-    case SDLK_BACKSPACE: return 0x41;
-    case SDLK_TAB: return 0x42;
-    case SDLK_SPACE: return 0x40;
-    case SDLK_QUOTE: return 0x2A;
-    case SDLK_COMMA: return 0x38;
-    case SDLK_MINUS: return 0x0B;
-    case SDLK_PERIOD: return 0x39;
-    case SDLK_SLASH: return 0x3A;
-    case SDLK_0: return 0x0A;
-    case SDLK_1: return 0x01;
-    case SDLK_2: return 0x02;
-    case SDLK_3: return 0x03;
-    case SDLK_4: return 0x04;
-    case SDLK_5: return 0x05;
-    case SDLK_6: return 0x06;
-    case SDLK_7: return 0x07;
-    case SDLK_8: return 0x08;
-    case SDLK_9: return 0x09;
-    case SDLK_SEMICOLON: return 0x29;
-    case SDLK_EQUALS: return 0x0C;
-    case SDLK_LEFTBRACKET: return 0x1A;
-    case SDLK_BACKSLASH: return 0x0D;
-    case SDLK_RIGHTBRACKET: return 0x1B;
-    case SDLK_BACKQUOTE: return 0x00;
-    case SDLK_a: return 0x20;
-    case SDLK_b: return 0x35;
-    case SDLK_c: return 0x33;
-    case SDLK_d: return 0x22;
-    case SDLK_e: return 0x12;
-    case SDLK_f: return 0x23;
-    case SDLK_g: return 0x24;
-    case SDLK_h: return 0x25;
-    case SDLK_i: return 0x17;
-    case SDLK_j: return 0x26;
-    case SDLK_k: return 0x27;
-    case SDLK_l: return 0x28;
-    case SDLK_m: return 0x37;
-    case SDLK_n: return 0x36;
-    case SDLK_o: return 0x18;
-    case SDLK_p: return 0x19;
-    case SDLK_q: return 0x10;
-    case SDLK_r: return 0x13;
-    case SDLK_s: return 0x21;
-    case SDLK_t: return 0x14;
-    case SDLK_u: return 0x16;
-    case SDLK_v: return 0x34;
-    case SDLK_w: return 0x11;
-    case SDLK_x: return 0x32;
-    case SDLK_y: return 0x15;
-    case SDLK_z: return 0x31;
-    //case SDLK_CAPSLOCK: return 0x62;
-    case SDLK_F1: return 0x50;
-    case SDLK_F2: return 0x51;
-    case SDLK_F3: return 0x52;
-    case SDLK_F4: return 0x53;
-    case SDLK_F5: return 0x54;
-    case SDLK_F6: return 0x55;
-    case SDLK_F7: return 0x56;
-    case SDLK_F8: return 0x57;
-    case SDLK_F9: return 0x58;
-    case SDLK_F10: return 0x59;
-    case SDLK_INSERT: return 0x66; // Left amiga
-    case SDLK_HOME: return 0x67; // Right amiga
-    //case SDLK_PAGEUP: return 0xFF;
-    case SDLK_DELETE: return 0x46;
-    //case SDLK_END: return 0xFF;
-    case SDLK_PAGEDOWN: return 0x5F; // Help
-    case SDLK_RIGHT: return 0x4E;
-    case SDLK_LEFT: return 0x4F;
-    case SDLK_DOWN: return 0x4D;
-    case SDLK_UP: return 0x4C;
-    case SDLK_LCTRL: return 0x63;
-    case SDLK_LSHIFT: return 0x60;
-    case SDLK_LALT: return 0x64;
-    //case SDLK_LGUI: return 0xFF;
-    //case SDLK_RCTRL: return 0xFF;
-    case SDLK_RSHIFT: return 0x61;
-    case SDLK_RALT: return 0x65;
-    //case SDLK_RGUI: return 0xFF;
-    }
-    return 0xFF;
-}
-
-char with_shift(char c)
-{
-    switch (c) {
-    case '1': return '!';
-    case '2': return '@';
-    case '3': return '#';
-    case '4': return '$';
-    case '5': return '%';
-    case '6': return '^';
-    case '7': return '&';
-    case '8': return '*';
-    case '9': return '(';
-    case '0': return ')';
-    case '-': return '_';
-    case '=': return '+';
-    case '\\': return '|';
-    case ',': return '<';
-    case '.': return '>';
-    case '/': return '?';
-    case '[': return '{';
-    case ']': return '}';
-    case ';': return ':';
-    case '\'': return '"';
-    }
-    return c;
+    char filename[256];
+    auto t = std::time(nullptr);
+    tm* local = std::localtime(&t);
+    snprintf(filename, sizeof(filename), "%s_%04d%02d%02d%02d%02d%02d.%s", prefix, 1900 + local->tm_year, 1 + local->tm_mon, local->tm_mday, local->tm_hour, local->tm_min, local->tm_sec, extension);
+    return filename;
 }
 
 class driver {
@@ -201,28 +109,30 @@ public:
     static constexpr int screen_height = 2 * (yend - ystart);
 
     explicit driver()
-        : current_frame_(HPIXELS * VPIXELS)
-        , last_frame_(HPIXELS * VPIXELS)
     {
         window_.reset(SDL_CreateWindow("vAmiga", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED, screen_width, screen_height, SDL_WINDOW_SHOWN));
         if (!window_)
             throw_sdl_error("SDL_CreateWindow");
 
         renderer_.reset(SDL_CreateRenderer(window_.get(), -1, SDL_RENDERER_ACCELERATED/* | SDL_RENDERER_PRESENTVSYNC*/));
+        if (!renderer_) // E.g. the dummy video driver (-headless)
+            renderer_.reset(SDL_CreateRenderer(window_.get(), -1, SDL_RENDERER_SOFTWARE));
         if (!renderer_)
             throw_sdl_error("SDL_CreateRenderer");
 
-        texture_.reset(SDL_CreateTexture(renderer_.get(), SDL_PIXELFORMAT_RGBA32, SDL_TEXTUREACCESS_STREAMING, screen_width, screen_height));
-        if (!texture_)
-            throw_sdl_error("SDL_CreateTexture");
-
         overlay_.reset(SDL_CreateTexture(renderer_.get(), SDL_PIXELFORMAT_RGBA32, SDL_TEXTUREACCESS_STREAMING, screen_width, screen_height));
-        if (!texture_)
+        if (!overlay_)
             throw_sdl_error("SDL_CreateTexture");
 
         if (SDL_SetTextureBlendMode(overlay_.get(), SDL_BLENDMODE_BLEND))
             throw_sdl_error("SDL_SetTextureBlendMode");
 
+        create_noise();
+
+        wake_event_ = SDL_RegisterEvents(1);
+        if (wake_event_ == static_cast<Uint32>(-1))
+            throw_sdl_error("SDL_RegisterEvents");
+
         SDL_AudioSpec want {};
         SDL_AudioSpec have;
 
@@ -243,113 +153,154 @@ public:
             throw std::runtime_error { "Audio format not supported" };
         }
 
-        emulator_.launch(this, [](const void* ptr, Message msg) {
-            reinterpret_cast<driver*>(const_cast<void*>(ptr))->msg_queue_callback(msg);
-        });
+        // Controller state is sampled once per main loop iteration (see poll_controllers), so don't have SDL
+        // queue an event for every axis wiggle. Hotplug events are still delivered.
+        for (const auto type : { SDL_CONTROLLERAXISMOTION, SDL_CONTROLLERBUTTONDOWN, SDL_CONTROLLERBUTTONUP, SDL_JOYAXISMOTION, SDL_JOYBALLMOTION, SDL_JOYHATMOTION, SDL_JOYBUTTONDOWN, SDL_JOYBUTTONUP })
+            SDL_EventState(type, SDL_IGNORE);
+        // Community mapping database (https://github.com/gabomdq/SDL_GameControllerDB) if present
+        SDL_GameControllerAddMappingsFromFile("gamecontrollerdb.txt");
     }
 
     ~driver() {
-        emulator_.powerOff();
         SDL_CloseAudioDevice(dev_);
+        for (auto& inst : instances_)
+            inst->emulator.powerOff();
     }
 
     int run(int argc, char* argv[])
     {
-        emulator_.set(ConfigScheme::A500_OCS_1MB);
-        emulator_.set(Option::HOST_SAMPLE_RATE, audio_sample_rate);
-        for (int n = 0; n < 4; ++n)
-            emulator_.set(Option::HDC_CONNECT, false, n);
-
-        bool auto_power_on = true;
-        int drive = 0, hd = 0;
-        std::string ext_rom;
+        // Frontend options are handled here, everything else configures the emulator instances (see instance_args)
+        std::vector<const char*> args;
+        int instance_count = 1;
+        std::string golden_file, golden_frames;
+        std::string type_file;
+        isize type_frame = 0;
+        bool golden_record = false;
+        bool lockstep = false;
         for (int i = 1; i < argc; ++i) {
-            if (!strcmp(argv[i], "-bigbox")) {
-                emulator_.set(ConfigScheme::A500_ECS_1MB);
-                emulator_.set(Option::MEM_CHIP_RAM, 2048);
-                emulator_.set(Option::MEM_FAST_RAM, 8192);
-                emulator_.set(Option::MEM_SLOW_RAM, 0);
-                emulator_.set(Option::CPU_OVERCLOCKING, 14);
-                emulator_.set(Option::CPU_REVISION, (i64)CPURevision::CPU_68EC020);
+            if (!strcmp(argv[i], "-instances") && i + 1 < argc) {
+                instance_count = std::clamp(atoi(argv[++i]), 1, max_instances);
                 continue;
-            } else if (!strcmp(argv[i], "-a600")) {
-                emulator_.set(ConfigScheme::A500_ECS_1MB);
-                emulator_.set(Option::MEM_CHIP_RAM, 1024);
-                emulator_.set(Option::MEM_SLOW_RAM, 0);
+            } else if (!strcmp(argv[i], "-profile")) {
+                uint32_t window = 250;
+                if (i + 1 < argc && isdigit(static_cast<unsigned char>(argv[i + 1][0])))
+                    window = static_cast<uint32_t>(atoi(argv[++i]));
+                profiler_ = std::make_unique<profiler>(window);
                 continue;
-            }
-
-            std::filesystem::path p { argv[i] };
-
-            const auto suffix = util::uppercased(p.extension().string());
-            if (suffix == ".TXT") {
-                std::cout << "Executing script: " << argv[i] << "\n";
-                std::ifstream in{argv[i]};
-                if (!in || !in.is_open())
-                    throw std::runtime_error{"Error opening: " + std::string{argv[i]}};
-                emulator_.retroShell.execScript(in);
-                auto_power_on = false;
+            } else if (!strcmp(argv[i], "-headless")) {
+                headless_ = true; // The drivers were chosen in main
                 continue;
-            } else if (suffix == ".SNP") {
-                std::cout << "Loading snapshot: " << argv[i] << "\n";
-                Snapshot snp{argv[i]};
-                emulator_.powerOn();
-                amiga_.loadSnapshot(snp);
-                emulator_.run();
-                auto_power_on = false;
-                break;
-            } else if (suffix == ".ROM") {
-                emulator_.mem.loadRom(argv[i]);
-            } else if (suffix == ".BIN") {
-#if 0  // XXX
-                if (ExtendedRomFile::isExtendedRomFile(p))
-                    ext_rom = argv[i]; // load outside loop as loadRom deletes any extended rom (!)
-                else if (RomFile::isRomFile(p))
-                    amiga_.mem.loadRom(p);
-                else
-                    throw std::runtime_error { "Unknown binary file: " + std::string { argv[i] } };
-#else
-                emulator_.mem.loadRom(p);
-#endif
-            } else if (suffix == ".HDF" && hd < 4) {
-                emulator_.set(Option::HDC_CONNECT, true, hd);
-                HardDriveAPI *dh[] = { &emulator_.hd0, &emulator_.hd1, &emulator_.hd2, &emulator_.hd3 };
-                dh[hd]->attach(p);
-#ifndef NDEBUG
-                WT_DEBUG = 1;
+            } else if (!strcmp(argv[i], "-latency")) {
+                latency_test_ = true;
+                continue;
+            } else if (!strcmp(argv[i], "-joymap") && i + 1 < argc) {
+                if (SDL_GameControllerAddMappingsFromFile(argv[++i]) < 0)
+                    throw_sdl_error("SDL_GameControllerAddMappingsFromFile " + std::string { argv[i] });
+                continue;
+            } else if (!strcmp(argv[i], "-joythreshold") && i + 1 < argc) {
+                joy_threshold_ = std::clamp(atoi(argv[++i]), 1, 32767);
+                continue;
+            } else if (!strcmp(argv[i], "-joyfire") && i + 1 < argc) {
+                // Comma separated SDL button names, e.g. "a,b,rightshoulder"
+                joy_fire_buttons_.clear();
+                std::istringstream iss { argv[++i] };
+                for (std::string name; std::getline(iss, name, ',');) {
+                    const auto button = SDL_GameControllerGetButtonFromString(name.c_str());
+                    if (button == SDL_CONTROLLER_BUTTON_INVALID)
+                        throw std::runtime_error { "Unknown controller button: " + name };
+                    joy_fire_buttons_.push_back(button);
+                }
+                continue;
+            } else if (!strcmp(argv[i], "-serial") && i + 1 < argc) {
+                ++i;
+#ifndef _WIN32
+                if (!strcmp(argv[i], "pty")) {
+                    serial_ = serial_bridge::pty();
+                    continue;
+                }
 #endif
-                emulator_.defaults.set("HD" + std::to_string(hd) + "_PATH", p.string());
-                emulator_.set(Option::HDR_WRITE_THROUGH, true, hd);
-                ++hd;
-            } else if (drive < 4) {
-                std::cout << "Inserting in DF" << drive << ": " << argv[i] << "\n";
-                if (drive)
-                    emulator_.set(Option::DRIVE_CONNECT, true, { drive });
-                FloppyDriveAPI *df[] = { &emulator_.df0, &emulator_.df1, &emulator_.df2, &emulator_.df3 };
-                const bool wp = false; // TODO write-protect true as default
-                auto floppy = std::unique_ptr<MediaFile>(MediaFile::make(p));
-                df[drive]->insertMedia(*floppy, wp);
-                ++drive;
+                serial_ = serial_bridge::tcp(parse_port(argv[i]));
+                continue;
+            } else if ((!strcmp(argv[i], "-golden") || !strcmp(argv[i], "-golden-record")) && i + 1 < argc) {
+                golden_record = !strcmp(argv[i], "-golden-record");
+                golden_file = argv[++i];
+                continue;
+            } else if (!strcmp(argv[i], "-golden-frames") && i + 1 < argc) {
+                golden_frames = argv[++i];
+                continue;
+            } else if (!strcmp(argv[i], "-stream") && i + 1 < argc) {
+                stream_ = std::make_unique<stream::server>(parse_port(argv[++i]), screen_width, screen_height / 2, audio_sample_rate);
+                continue;
+            } else if (!strcmp(argv[i], "-cmd") && i + 1 < argc) {
+                ++i;
+                commands_ = !strcmp(argv[i], "stdin") ? command_channel::from_stdin() : command_channel::tcp(parse_port(argv[i]));
+                commands_->on_batch([this] { wake_main_loop(-1); });
+                continue;
+            } else if (!strcmp(argv[i], "-type") && i + 1 < argc) {
+                type_file = argv[++i];
+                if (i + 1 < argc && isdigit(static_cast<unsigned char>(argv[i + 1][0])))
+                    type_frame = atoi(argv[++i]);
+                continue;
+            } else if (!strcmp(argv[i], "-lockstep")) {
+                lockstep = true;
+                if (i + 1 < argc && isdigit(static_cast<unsigned char>(argv[i + 1][0])))
+                    lockstep_frames_ = atoi(argv[++i]);
+                continue;
+            } else if (!strcmp(argv[i], "-format") && i + 1 < argc) {
+                ++i;
+                if (!strcmp(argv[i], "rgba"))
+                    format_ = output_format::rgba32;
+                else if (!strcmp(argv[i], "rgb565"))
+                    format_ = output_format::rgb565;
+                else if (!strcmp(argv[i], "yuv"))
+                    format_ = output_format::yuv420;
+                else
+                    throw std::runtime_error { "Unknown output format: " + std::string { argv[i] } + " (rgba, rgb565 or yuv)" };
+                continue;
             }
+            args.push_back(argv[i]);
         }
 
-        if (!emulator_.mem.getInfo().hasRom) {
-            RomFile rom { "kick13.rom" };
-            emulator_.mem.loadRom(rom);
-        } else if (!ext_rom.empty()) {
-            emulator_.mem.loadExt(ext_rom);
+        if (!golden_file.empty()) {
+            if (golden_record)
+                golden_ = golden_checker::record(golden_file, golden_checker::parse_frames(golden_frames));
+            else
+                golden_ = golden_checker::verify(golden_file);
         }
 
-        if (auto_power_on) {
-            emulator_.powerOn();
-            emulator_.run();
+        if (lockstep) {
+            instance_count = std::max(instance_count, 2);
+            lockstep_ = std::make_unique<lockstep_checker>(instance_count);
+        }
+
+        tiled_ = instance_count > 1;
+        for (int n = 0; n < instance_count; ++n)
+            add_instance();
+        layout_tiles();
+        for (auto& inst : instances_)
+            configure(*inst, instance_args(args, inst->index));
+
+        if (!type_file.empty()) {
+            std::ifstream in { type_file, std::ios::binary };
+            if (!in)
+                throw std::runtime_error { "Error opening: " + type_file };
+            type_text(*instances_[0], std::string { std::istreambuf_iterator<char> { in }, std::istreambuf_iterator<char> {} }, type_frame);
         }
 
         SDL_PauseAudioDevice(dev_, false); // unpause
 
+        const int result = main_loop();
+        return lockstep_ ? lockstep_finish(result) : result;
+    }
+
+    int main_loop()
+    {
         for (uint32_t frame = 0;; ++frame) {
+            // Block until input arrives (or it's time to look for a new frame) instead of sleeping a fixed
+            // amount, so events reach the emulator as soon as the host delivers them. SDL only allows
+            // pumping events on the main thread, so this is as early as they can be seen.
             SDL_Event e;
-            while (SDL_PollEvent(&e)) {
+            for (bool have_event = SDL_WaitEventTimeout(&e, wait_timeout()); have_event; have_event = SDL_PollEvent(&e)) {
                 switch (e.type) {
                 case SDL_QUIT:
                     return 0;
@@ -360,21 +311,18 @@ public:
                     } else if (e.key.keysym.sym == SDLK_F11) {
                         if (e.key.keysym.mod & KMOD_SHIFT) {
 #ifdef SCREEN_RECORDER
-                            if (!amiga_.denise.screenRecorder.isRecording()) {
-                                amiga_.denise.screenRecorder.startRecording(0, 0, HPIXELS, VPIXELS, 100'000, 1, 2);
+                            if (!focused().amiga.denise.screenRecorder.isRecording()) {
+                                focused().amiga.denise.screenRecorder.startRecording(0, 0, HPIXELS, VPIXELS, 100'000, 1, 2);
                                 std::cout << "Recording started\n";
                             } else {
-                                amiga_.denise.screenRecorder.stopRecording();
+                                focused().amiga.denise.screenRecorder.stopRecording();
                             }
 #endif
                         } else {
-                            std::unique_ptr<MediaFile> snapshot { amiga_.takeSnapshot() };
+                            std::unique_ptr<MediaFile> snapshot { focused().amiga.takeSnapshot() };
                             assert(snapshot);
                             if (snapshot) {
-                                char filename[256];
-                                auto t = std::time(nullptr);
-                                tm* local = std::localtime(&t);
-                                snprintf(filename, sizeof(filename), "snapshot_%04d%02d%02d%02d%02d%02d.snp", 1900 + local->tm_year, 1 + local->tm_mon, local->tm_mday, local->tm_hour, local->tm_min, local->tm_sec);
+                                const auto filename = timestamped_filename("snapshot", "snp");
                                 std::cout << "Saving snapshot to " << filename << "\n";
                                 snapshot->writeToFile(filename);
                             }
@@ -399,177 +347,1279 @@ public:
                     if (handle_joystick_key(e.key.keysym.sym, e.type == SDL_KEYUP))
                         break;
                     if (const auto key = convert_key(e.key.keysym.sym); key != 0xFF) {
-                        if (e.type == SDL_KEYUP)
-                            emulator_.keyboard.release(key);
-                        else
-                            emulator_.keyboard.press(key);
+                        if (e.type == SDL_KEYUP) {
+                            send_input([key](VAmiga& a) { a.keyboard.release(key); });
+                        } else {
+                            send_input([key](VAmiga& a) { a.keyboard.press(key); });
+                            start_latency_probe(e.key.timestamp);
+                        }
                     }
                     break;
                 case SDL_MOUSEBUTTONDOWN:
                 case SDL_MOUSEBUTTONUP:
                     if (e.button.button == SDL_BUTTON_LEFT || e.button.button == SDL_BUTTON_RIGHT) {
                         if (!mouse_captured_) {
-                            if (overlay_active_)
+                            if (overlay_active_) {
                                 handle_overlay_mouse(e.button);
-                            else
+                            } else if (e.button.button == SDL_BUTTON_RIGHT && (SDL_GetModState() & KMOD_SHIFT)) {
+                                focus_instance_at(e.button.x, e.button.y);
+                                if (e.type == SDL_MOUSEBUTTONUP)
+                                    paste_clipboard();
+                            } else {
+                                focus_instance_at(e.button.x, e.button.y);
                                 capture_mouse(true);
+                            }
                         } else {
 			  const bool pressed = e.type == SDL_MOUSEBUTTONDOWN; // TODO middle ?
 			  bool left = (e.button.button == SDL_BUTTON_LEFT);
-			  auto& mouse = emulator_.controlPort1.mouse;
+			  const auto action = pressed ? (left ? GamePadAction::PRESS_LEFT : GamePadAction::PRESS_RIGHT) : (left ? GamePadAction::RELEASE_LEFT : GamePadAction::RELEASE_RIGHT);
+			  flush_mouse_motion(); // Keep ordering relative to coalesced motion
+			  send_input([action](VAmiga& a) { a.controlPort1.mouse.trigger(action); });
 			  if (pressed)
-			    mouse.trigger(left ? GamePadAction::PRESS_LEFT : GamePadAction::PRESS_RIGHT);
-			  else
-			    mouse.trigger(left ? GamePadAction::RELEASE_LEFT : GamePadAction::RELEASE_RIGHT);
+			    start_latency_probe(e.button.timestamp);
                         }
                     }
                     break;
                 case SDL_MOUSEMOTION:
                     if (mouse_captured_ && (e.motion.xrel || e.motion.yrel)) {
+                        // Coalesced and forwarded once all pending events have been handled
 #ifdef WSL2_MOUSE_HACK
                         // Probably only for WSL2: xrel/yrel are actually *not* relative (and x/y don't update)??
-                        amiga_.controlPort1.mouse.setDxDy(e.motion.xrel - last_mouse_x_, e.motion.yrel - last_mouse_y_);
+                        mouse_dx_ += e.motion.xrel - last_mouse_x_;
+                        mouse_dy_ += e.motion.yrel - last_mouse_y_;
                         last_mouse_x_ = e.motion.xrel;
                         last_mouse_y_ = e.motion.yrel;
 #else
-                        emulator_.controlPort1.mouse.setDxDy(e.motion.xrel, e.motion.yrel);
-                        // Make sure mouse doesn't end up on the window border
-                        SDL_WarpMouseInWindow(window_.get(), screen_width / 2, screen_height / 2);
+                        mouse_dx_ += e.motion.xrel;
+                        mouse_dy_ += e.motion.yrel;
 #endif
                     }
                     break;
+                case SDL_CONTROLLERDEVICEADDED:
+                    add_controller(e.cdevice.which);
+                    break;
+                case SDL_CONTROLLERDEVICEREMOVED:
+                    remove_controller(e.cdevice.which);
+                    break;
                 case SDL_WINDOWEVENT:
                     if (e.window.event == SDL_WINDOWEVENT_FOCUS_LOST || e.window.event == SDL_WINDOWEVENT_LEAVE) {
                         capture_mouse(false);
+                    } else if (e.window.event == SDL_WINDOWEVENT_EXPOSED || e.window.event == SDL_WINDOWEVENT_SIZE_CHANGED) {
+                        force_render_ = true;
                     }
+                    break;
+                default:
+                    if (e.type == wake_event_ && e.user.code == static_cast<Sint32>(MsgType::RSH_UPDATE))
+                        overlay_dirty_ = true;
                 }
             }
-
-            bool update = overlay_active_ && overlay_dirty_;
-            if (power_is_on_) {
-                // TODO: Implement new long frame logic
-
-                VideoPortAPI& vp = emulator_.videoPort;
-                vp.lockTexture();
-                isize nr;
-                bool lof, prevlof;
-                const u32 *ptr = vp.getTexture(&nr, &lof, &prevlof);
-                if (ptr != last_buffer_pointer_) { // HACK: Don't update if not a new frame
-                    std::memcpy(&current_frame_[0], ptr, HPIXELS * VPIXELS * sizeof(uint32_t));
-
-                    void* pixels;
-                    int pitch;
-                    if (SDL_LockTexture(texture_.get(), nullptr, &pixels, &pitch))
-                        throw_sdl_error("SDL_LockTexture");
-                    uint8_t* dest1 = reinterpret_cast<uint8_t*>(pixels) + !lof * pitch;
-                    uint8_t* dest2 = reinterpret_cast<uint8_t*>(pixels) + lof * pitch;
-                    const uint32_t* src1 = &current_frame_[0];
-                    const uint32_t* src2 = (lof == last_frame_type_) ? &current_frame_[0] : &last_frame_[0];
-
-                    src1 += HPIXELS * ystart + HBLANK_MAX * 4;//xstart;
-                    src2 += HPIXELS * ystart + HBLANK_MAX * 4; // xstart;
-                    for (uint32_t y = 0; y < screen_height / 2; ++y) {
-                        std::memcpy(dest1, src1, screen_width * sizeof(uint32_t));
-                        std::memcpy(dest2, src2, screen_width * sizeof(uint32_t));
-                        dest1 += 2 * pitch;
-                        dest2 += 2 * pitch;
-                        src1 += HPIXELS;
-                        src2 += HPIXELS;
-                    }
-                    SDL_UnlockTexture(texture_.get());
-                    //SDL_RenderClear(renderer_.get());
-
-                    std::swap(current_frame_, last_frame_);
-                    last_frame_type_ = lof;
-                    last_buffer_pointer_ = ptr;
+            flush_mouse_motion();
+            poll_controllers();
+            if (serial_)
+                pump_serial();
+            if (stream_)
+                pump_stream();
+            if (commands_)
+                pump_commands();
+
+            bool update = force_render_;
+            force_render_ = false;
+            const auto now = SDL_GetTicks();
+            const bool animate_noise = now - last_noise_ >= noise_interval;
+            if (animate_noise)
+                last_noise_ = now;
+            for (auto& inst : instances_) {
+                if (inst->powered_on.exchange(false)) {
+                    // The texture may still hold a picture from before the power cycle, and the noise has to go
+                    inst->texture_valid = false;
                     update = true;
                 }
-                vp.unlockTexture();
-                emulator_.wakeUp();
-            } else {
-                void* pixels;
-                int pitch;
-                if (SDL_LockTexture(texture_.get(), nullptr, &pixels, &pitch))
-                    throw_sdl_error("SDL_LockTexture");
-
-                static uint32_t rand_state = 1;
-                uint8_t* dest = reinterpret_cast<uint8_t*>(pixels);
-                for (uint32_t y = 0; y < screen_height / 2; ++y) {
-                    for (uint32_t x = 0; x < screen_width; ++x) {
-                        rand_state ^= rand_state << 13;
-                        rand_state ^= rand_state >> 17;
-                        rand_state ^= rand_state << 5;
-                        const uint32_t r = (uint8_t)rand_state;
-                        const uint32_t c = r << 16 | r << 8 | r;
-                        *(uint32_t*)(dest + x * sizeof(uint32_t)) = c;
-                        *(uint32_t*)(dest + x * sizeof(uint32_t) + pitch) = c;
-                    }
-
-                    dest += pitch * 2;
+                if (inst->power_is_on) {
+                    if (update_frame(*inst))
+                        update = true;
+                } else if (animate_noise) {
+                    move_noise(*inst);
+                    update = true;
                 }
-                SDL_UnlockTexture(texture_.get());
-
-                update = true;
-                last_buffer_pointer_ = nullptr;
             }
 
-            if (abort_)
-                return abort_ & 0xFF;
+            if (lockstep_ && lockstep_sync())
+                return 0;
 
-            if (overlay_active_)
-                update_overlay();
+            if (golden_ && golden_->done(static_cast<uint32_t>(instances_[0]->last_frame_nr)))
+                return golden_->finish();
 
-            if (update) {
-                SDL_RenderCopy(renderer_.get(), texture_.get(), nullptr, nullptr);
-                if (overlay_active_)
-                    SDL_RenderCopy(renderer_.get(), overlay_.get(), nullptr, nullptr);
-                SDL_RenderPresent(renderer_.get());
+            for (const auto& inst : instances_) {
+                if (inst->abort)
+                    return inst->abort & 0xFF;
+            }
+
+            if (overlay_active_ && update_overlay())
+                update = true;
+
+            // Nothing changed on screen, don't present the same image again
+            if (update && !headless_) {
+                render();
+                finish_latency_probe();
             }
-            
-            SDL_Delay(5);
         }
     }
 
 private:
-    sdl_init sdl_init_ { SDL_INIT_VIDEO | SDL_INIT_AUDIO };
+    static constexpr int max_instances = 16;
+    static constexpr int dirty_tile_size = 32;
+    static constexpr int noise_slack = 64; // The noise texture is this much larger than a field
+    static constexpr uint32_t noise_interval = 40; // ms, 25 fps
+    static constexpr int idle_timeout = 500; // ms
+    static constexpr int socket_poll_interval = 20; // ms
+
+    // Format of the emulator textures. The narrower ones are converted while cropping and weaving, so
+    // they cost no extra pass and cut upload bandwidth to 1/2 (RGB565) or 3/8 (YUV 4:2:0).
+    enum class output_format { rgba32, rgb565, yuv420 };
+
+    // One emulator with its own output texture. With -instances several of them run side by side, tiled in
+    // the window. Input, the retro shell and audio follow the focused one.
+    struct instance {
+        driver* owner;
+        int index;
+        VAmiga emulator;
+        AmigaAPI& amiga = emulator.amiga;
+        SDL_Texture_ptr texture;
+        SDL_Rect tile {};
+        const u32* last_buffer_pointer = nullptr;
+        bool last_frame_type = false;
+        isize last_frame_nr = 0;
+        std::vector<uint32_t> current_frame = std::vector<uint32_t>(HPIXELS * VPIXELS);
+        std::vector<uint32_t> last_frame = std::vector<uint32_t>(HPIXELS * VPIXELS);
+        std::vector<uint8_t> staging; // Woven frame in the output format
+        std::vector<uint8_t> uploaded; // What the texture holds, if texture_valid
+        bool texture_valid = false;
+        bool power_is_on = false;
+        std::atomic<bool> powered_on { false }; // Set by the emulator thread, the texture needs a full upload
+        // Lockstep mode
+        bool held = false; // Paused after a frame, see lockstep_sync
+        bool at_barrier = false; // Held and known to have stopped, its latest frame has been seen
+        bool golden_hold = false; // Paused right before a wanted golden frame
+        isize stats_frame = 0;
+        double busy_ms = 0;
+        isize busy_frames = 0;
+        std::atomic<bool> running { false };
+        SDL_Rect noise_src {}; // Part of the noise texture shown while powered off
+        int abort = 0;
+    };
+
+    // Retro shell commands from the command channel, run one at a time
+    struct command_batch {
+        int id = 0;
+        std::vector<std::string> commands;
+        size_t next = 0;
+        int errors = 0;
+        uint32_t start_ticks = 0;
+        // The command being run
+        bool busy = false;
+        instance* target = nullptr;
+        std::string text_before;
+        size_t line_start = 0; // Of the prompt line in text_before
+        uint32_t command_ticks = 0;
+    };
+
+    // Text being typed into an instance
+    struct typing_state {
+        struct key {
+            uint8_t code;
+            bool shift;
+        };
+        instance* target = nullptr;
+        std::deque<key> keys;
+        isize start_frame = 0;
+        bool started = false;
+        int pause = 0; // Frames to wait before the next key
+        int since_newline = 0;
+        size_t total = 0;
+        uint32_t start_ticks = 0;
+    };
+
+    struct controller {
+        SDL_GameController_ptr handle;
+        SDL_JoystickID id;
+        int port; // 1 or 2, 0 if both ports are taken
+        uint8_t state;
+    };
+
+    sdl_init sdl_init_ { SDL_INIT_VIDEO | SDL_INIT_AUDIO | SDL_INIT_GAMECONTROLLER };
     SDL_Window_ptr window_;
     SDL_Renderer_ptr renderer_;
-    SDL_Texture_ptr texture_;
     SDL_Texture_ptr overlay_;
+    SDL_Texture_ptr noise_;
+    uint32_t noise_state_ = 1;
+    uint32_t last_noise_ = 0;
+    Uint32 wake_event_ = 0;
     SDL_AudioDeviceID dev_;
     bool need_halt_ = false;
+    bool headless_ = false;
     bool mouse_captured_ = false;
 #ifdef WSL2_MOUSE_HACK
     int last_mouse_x_ = 0;
     int last_mouse_y_ = 0;
 #endif
-    const u32* last_buffer_pointer_ = nullptr;
-    bool last_frame_type_ = false;
-    std::vector<uint32_t> current_frame_;
-    std::vector<uint32_t> last_frame_;
+    int mouse_dx_ = 0;
+    int mouse_dy_ = 0;
+    bool latency_test_ = false;
+    bool latency_probe_active_ = false;
+    uint32_t latency_probe_ticks_ = 0;
+    isize latency_probe_frame_ = 0;
+    std::vector<uint32_t> latency_results_;
+    std::vector<controller> controllers_;
+    int joy_threshold_ = 16000;
+    std::vector<SDL_GameControllerButton> joy_fire_buttons_ { SDL_CONTROLLER_BUTTON_A };
     bool overlay_active_ = false;
     bool overlay_dirty_ = true;
     bool overlay_blink_ = false;
-    bool power_is_on_ = false;
-    int abort_ = 0;
     uint64_t last_overlay_blink_ = 0;
-    std::string ser_buffer_;
-    VAmiga emulator_;
-    AmigaAPI& amiga_ = emulator_.amiga;
+    std::unique_ptr<profiler> profiler_;
+    bool show_profile_ = false;
+    uint64_t last_profile_update_ = 0;
+    std::vector<std::string> profile_lines_;
+    std::unique_ptr<serial_bridge> serial_;
+    std::unique_ptr<golden_checker> golden_;
+    std::unique_ptr<stream::server> stream_;
+    std::mutex stream_audio_mutex_;
+    std::vector<float> stream_scratch_; // Audio callback only
+    byte_ring stream_audio_ { audio_sample_rate / 4 * 2 * sizeof(float) }; // Filled by the audio callback, or lockstep_audio
+    std::vector<stream::input_event> stream_input_;
+    std::unique_ptr<command_channel> commands_;
+    typing_state typing_;
+    std::unique_ptr<lockstep_checker> lockstep_;
+    isize lockstep_frames_ = 0; // Stop after this many frames if non-zero
+    std::vector<std::function<void(VAmiga&)>> lockstep_inputs_; // For all instances at the next barrier
+    uint32_t lockstep_stats_ticks_ = 0;
+    int lockstep_reports_ = 0;
+    isize lockstep_audio_frame_ = 0; // The audio has been taken up to here
+    std::vector<float> lockstep_audio_;
+    command_batch batch_;
+    uint8_t stream_mouse_buttons_ = 0;
+    uint8_t stream_joystick_ = 0;
+    std::vector<std::unique_ptr<instance>> instances_;
+    std::atomic<size_t> focus_ { 0 }; // Read by the audio callback
+    output_format format_ = output_format::rgba32;
+    bool tiled_ = false;
+    bool force_render_ = false;
+
+    instance& focused()
+    {
+        return *instances_[focus_];
+    }
+
+    VAmiga& emulator()
+    {
+        return focused().emulator;
+    }
+
+    void add_instance()
+    {
+        auto inst = std::make_unique<instance>();
+        inst->owner = this;
+        inst->index = static_cast<int>(instances_.size());
+        const Uint32 pixel_format = format_ == output_format::rgb565 ? SDL_PIXELFORMAT_RGB565 : format_ == output_format::yuv420 ? SDL_PIXELFORMAT_IYUV : SDL_PIXELFORMAT_RGBA32;
+        inst->texture.reset(SDL_CreateTexture(renderer_.get(), pixel_format, SDL_TEXTUREACCESS_STREAMING, screen_width, screen_height));
+        if (!inst->texture)
+            throw_sdl_error("SDL_CreateTexture");
+        inst->staging.resize(frame_size());
+        inst->uploaded.resize(frame_size());
+        move_noise(*inst);
+        inst->emulator.launch(inst.get(), [](const void* ptr, Message msg) {
+            auto& i = *reinterpret_cast<instance*>(const_cast<void*>(ptr));
+            i.owner->msg_queue_callback(i, msg);
+        });
+        instances_.push_back(std::move(inst));
+    }
+
+    // Tiles are laid out in a grid at full resolution and the renderer scales the whole thing to the window
+    void layout_tiles()
+    {
+        const int n = static_cast<int>(instances_.size());
+        int cols = 1;
+        while (cols * cols < n)
+            ++cols;
+        const int rows = (n + cols - 1) / cols;
+        for (auto& inst : instances_)
+            inst->tile = { (inst->index % cols) * screen_width, (inst->index / cols) * screen_height, screen_width, screen_height };
+        if (!tiled_)
+            return;
+        SDL_SetWindowSize(window_.get(), cols * screen_width / 2, rows * screen_height / 2);
+        if (SDL_RenderSetLogicalSize(renderer_.get(), cols * screen_width, rows * screen_height))
+            throw_sdl_error("SDL_RenderSetLogicalSize");
+        update_title();
+    }
+
+    void focus_instance_at(int x, int y)
+    {
+        const SDL_Point pt { x, y };
+        for (const auto& inst : instances_) {
+            if (SDL_PointInRect(&pt, &inst->tile) && static_cast<size_t>(inst->index) != focus_) {
+                if (!lockstep_) // Input goes to all of them
+                    release_all(emulator());
+                // The next poll sends controllers held down to the new instance
+                for (auto& c : controllers_)
+                    c.state = 0;
+                focus_ = inst->index;
+                overlay_dirty_ = true;
+                force_render_ = true;
+                update_title();
+                break;
+            }
+        }
+    }
+
+    // Lets go of everything the frontend may be holding down on an instance
+    static void release_all(VAmiga& emulator)
+    {
+        emulator.keyboard.releaseAll();
+        for (auto* joystick : { &emulator.controlPort1.joystick, &emulator.controlPort2.joystick }) {
+            joystick->trigger(GamePadAction::RELEASE_XY);
+            joystick->trigger(GamePadAction::RELEASE_FIRE);
+        }
+        emulator.controlPort1.mouse.trigger(GamePadAction::RELEASE_LEFT);
+        emulator.controlPort1.mouse.trigger(GamePadAction::RELEASE_RIGHT);
+    }
+
+    void update_title()
+    {
+        std::string title { "vAmiga" };
+        if (tiled_)
+            title += " [" + std::to_string(focus_ + 1) + "/" + std::to_string(instances_.size()) + "]";
+        if (mouse_captured_)
+            title += " - mouse captured";
+        SDL_SetWindowTitle(window_.get(), title.c_str());
+    }
+
+    // The arguments for one instance: every plain one plus those prefixed with "@n:" (n is 1-based), so e.g.
+    // "@2:game.adf" only goes into the second instance
+    std::vector<const char*> instance_args(const std::vector<const char*>& args, int index) const
+    {
+        std::vector<const char*> res;
+        for (const char* arg : args) {
+            char* end = nullptr;
+            const long n = arg[0] == '@' ? strtol(arg + 1, &end, 10) : 0;
+            if (!end || end == arg + 1 || *end != ':') {
+                res.push_back(arg);
+                continue;
+            }
+            if (n < 1 || n > static_cast<long>(instances_.size()))
+                throw std::runtime_error { "No instance " + std::to_string(n) + " for " + arg };
+            if (n == index + 1)
+                res.push_back(end + 1);
+        }
+        return res;
+    }
+
+    void configure(instance& inst, const std::vector<const char*>& args)
+    {
+        VAmiga& emulator = inst.emulator;
+        emulator.set(ConfigScheme::A500_OCS_1MB);
+        emulator.set(Option::HOST_SAMPLE_RATE, audio_sample_rate);
+        for (int n = 0; n < 4; ++n)
+            emulator.set(Option::HDC_CONNECT, false, n);
+
+        bool auto_power_on = true;
+        int drive = 0, hd = 0;
+        std::string ext_rom;
+        for (const char* arg : args) {
+            if (!strcmp(arg, "-bigbox")) {
+                emulator.set(ConfigScheme::A500_ECS_1MB);
+                emulator.set(Option::MEM_CHIP_RAM, 2048);
+                emulator.set(Option::MEM_FAST_RAM, 8192);
+                emulator.set(Option::MEM_SLOW_RAM, 0);
+                emulator.set(Option::CPU_OVERCLOCKING, 14);
+                emulator.set(Option::CPU_REVISION, (i64)CPURevision::CPU_68EC020);
+                continue;
+            } else if (!strcmp(arg, "-a600")) {
+                emulator.set(ConfigScheme::A500_ECS_1MB);
+                emulator.set(Option::MEM_CHIP_RAM, 1024);
+                emulator.set(Option::MEM_SLOW_RAM, 0);
+                continue;
+            }
+
+            std::filesystem::path p { arg };
+
+            const auto suffix = util::uppercased(p.extension().string());
+            if (suffix == ".TXT") {
+                std::cout << "Executing script: " << arg << "\n";
+                std::ifstream in{arg};
+                if (!in || !in.is_open())
+                    throw std::runtime_error{"Error opening: " + std::string{arg}};
+                emulator.retroShell.execScript(in);
+                auto_power_on = false;
+                continue;
+            } else if (suffix == ".SNP") {
+                std::cout << "Loading snapshot: " << arg << "\n";
+                Snapshot snp{arg};
+                emulator.powerOn();
+                inst.amiga.loadSnapshot(snp);
+                emulator.run();
+                auto_power_on = false;
+                break;
+            } else if (suffix == ".ROM") {
+                emulator.mem.loadRom(arg);
+            } else if (suffix == ".BIN") {
+#if 0  // XXX
+                if (ExtendedRomFile::isExtendedRomFile(p))
+                    ext_rom = arg; // load outside loop as loadRom deletes any extended rom (!)
+                else if (RomFile::isRomFile(p))
+                    inst.amiga.mem.loadRom(p);
+                else
+                    throw std::runtime_error { "Unknown binary file: " + std::string { arg } };
+#else
+                emulator.mem.loadRom(p);
+#endif
+            } else if (suffix == ".HDF" && hd < 4) {
+                emulator.set(Option::HDC_CONNECT, true, hd);
+                HardDriveAPI *dh[] = { &emulator.hd0, &emulator.hd1, &emulator.hd2, &emulator.hd3 };
+                dh[hd]->attach(p);
+#ifndef NDEBUG
+                WT_DEBUG = 1;
+#endif
+                emulator.defaults.set("HD" + std::to_string(hd) + "_PATH", p.string());
+                // Only one instance may write back to the image
+                if (!inst.index)
+                    emulator.set(Option::HDR_WRITE_THROUGH, true, hd);
+                ++hd;
+            } else if (drive < 4) {
+                std::cout << "Inserting in DF" << drive << ": " << arg << "\n";
+                if (drive)
+                    emulator.set(Option::DRIVE_CONNECT, true, { drive });
+                FloppyDriveAPI *df[] = { &emulator.df0, &emulator.df1, &emulator.df2, &emulator.df3 };
+                const bool wp = false; // TODO write-protect true as default
+                auto floppy = std::unique_ptr<MediaFile>(MediaFile::make(p));
+                df[drive]->insertMedia(*floppy, wp);
+                ++drive;
+            }
+        }
+
+        if (!emulator.mem.getInfo().hasRom) {
+            RomFile rom { "kick13.rom" };
+            emulator.mem.loadRom(rom);
+        } else if (!ext_rom.empty()) {
+            emulator.mem.loadExt(ext_rom);
+        }
+
+        if (auto_power_on) {
+            emulator.powerOn();
+            emulator.run();
+        }
+    }
+
+    // Bytes per line of the staging buffers (for YUV the luma plane, chroma lines are half that)
+    int staging_pitch() const
+    {
+        switch (format_) {
+        case output_format::rgb565:
+            return screen_width * static_cast<int>(sizeof(uint16_t));
+        case output_format::yuv420:
+            return screen_width;
+        default:
+            return screen_width * static_cast<int>(sizeof(uint32_t));
+        }
+    }
+
+    size_t frame_size() const
+    {
+        const size_t size = static_cast<size_t>(staging_pitch()) * screen_height;
+        return format_ == output_format::yuv420 ? size + 2 * static_cast<size_t>((staging_pitch() + 1) / 2) * (screen_height / 2) : size;
+    }
+
+    // Copies a new frame (if there is one) to the instance's texture, returns true if anything visible changed
+    bool update_frame(instance& inst)
+    {
+        // TODO: Implement new long frame logic
+
+        bool updated = false;
+        bool golden_hold = inst.golden_hold;
+        const bool golden_stopped = inst.golden_hold && !inst.running; // Paused, so the texture is final
+        // Lockstep: once the pause is confirmed nothing changes the texture any more, so whatever it holds now is
+        // the frame the instance stopped after
+        const bool stopped = inst.held && !inst.running;
+        bool new_frame = false;
+        VideoPortAPI& vp = inst.emulator.videoPort;
+        vp.lockTexture();
+        isize nr;
+        bool lof, prevlof;
+        const u32 *ptr = vp.getTexture(&nr, &lof, &prevlof);
+        if (ptr != inst.last_buffer_pointer) { // HACK: Don't update if not a new frame
+            new_frame = true;
+            inst.last_frame_nr = nr;
+            if (!inst.index && profiler_)
+                profiler_->frame(static_cast<uint32_t>(nr));
+            if (&inst == typing_.target)
+                type_keys(inst);
+            std::memcpy(&inst.current_frame[0], ptr, HPIXELS * VPIXELS * sizeof(uint32_t));
+            if (!inst.index && golden_) {
+                if (golden_->wants(static_cast<uint32_t>(nr)))
+                    golden_->submit(static_cast<uint32_t>(nr), &inst.current_frame[HPIXELS * ystart + xstart], xend - xstart, yend - ystart, HPIXELS);
+                // Stop after the frame in progress if it's wanted (lockstep stops after every frame anyway)
+                golden_hold = !lockstep_ && golden_->wants(static_cast<uint32_t>(nr) + 1);
+            }
+            if (lockstep_)
+                lockstep_frame(inst, nr);
+            if (!inst.index && stream_ && stream_->has_clients()) {
+                // Tile diff against the previous field before it's overwritten by the swap below
+                const size_t offset = HPIXELS * ystart + HBLANK_MAX * 4;
+                stream_->send_frame(static_cast<uint32_t>(nr), &inst.current_frame[offset], &inst.last_frame[offset], HPIXELS);
+            }
+
+            const uint32_t* src1 = &inst.current_frame[0];
+            const uint32_t* src2 = (lof == inst.last_frame_type) ? &inst.current_frame[0] : &inst.last_frame[0];
+
+            src1 += HPIXELS * ystart + HBLANK_MAX * 4;//xstart;
+            src2 += HPIXELS * ystart + HBLANK_MAX * 4; // xstart;
+            // The current field goes to the even lines for long frames, the odd ones for short frames
+            const uint32_t* top = lof ? src1 : src2;
+            const uint32_t* bottom = lof ? src2 : src1;
+            switch (format_) {
+            case output_format::rgba32:
+                weave_rgba32(inst.staging.data(), staging_pitch(), top, bottom);
+                break;
+            case output_format::rgb565:
+                weave_rgb565(inst.staging.data(), staging_pitch(), top, bottom);
+                break;
+            case output_format::yuv420:
+                weave_yuv420(inst.staging.data(), staging_pitch(), top, bottom);
+                break;
+            }
+            updated = upload_dirty_tiles(inst);
+            //SDL_RenderClear(renderer_.get());
+
+            std::swap(inst.current_frame, inst.last_frame);
+            inst.last_frame_type = lof;
+            inst.last_buffer_pointer = ptr;
+        }
+        vp.unlockTexture();
+        // Not while the texture is locked, the emulator needs it to finish the frame
+        if (golden_hold && new_frame)
+            inst.emulator.pause();
+        else if (golden_hold ? golden_stopped : inst.golden_hold)
+            inst.emulator.run(); // Stopped before the wanted frame was begun, or it has been collected
+        inst.golden_hold = golden_hold;
+        if (lockstep_) {
+            if (new_frame && !inst.held) {
+                inst.emulator.pause();
+                inst.held = true;
+            } else if (stopped) {
+                inst.at_barrier = true;
+            }
+        }
+        inst.emulator.wakeUp();
+        return updated;
+    }
+
+    static bool rect_differs(const uint8_t* a, const uint8_t* b, int bytes, int rows, int pitch)
+    {
+        for (int y = 0; y < rows; ++y, a += pitch, b += pitch) {
+            if (std::memcmp(a, b, bytes))
+                return true;
+        }
+        return false;
+    }
+
+    // Compares the staged frame against the texture contents in tiles and uploads runs of dirty tiles (per row
+    // of tiles) with SDL_UpdateTexture. Static screens then cost a few memcmps instead of a full upload.
+    // Returns false if nothing changed.
+    bool upload_dirty_tiles(instance& inst)
+    {
+        const int pitch = staging_pitch();
+        const int bpp = pitch / screen_width;
+        const int chroma_pitch = (pitch + 1) / 2;
+        const size_t u_offset = static_cast<size_t>(pitch) * screen_height;
+        const size_t v_offset = u_offset + static_cast<size_t>(chroma_pitch) * (screen_height / 2);
+        const uint8_t* cur = inst.staging.data();
+        const uint8_t* old = inst.uploaded.data();
+
+        // Tiles are even sized and aligned, so they cover whole 2x2 chroma blocks
+        const auto dirty = [&](int x, int y, int w, int h) {
+            if (!inst.texture_valid || rect_differs(cur + y * pitch + x * bpp, old + y * pitch + x * bpp, w * bpp, h, pitch))
+                return true;
+            if (format_ != output_format::yuv420)
+                return false;
+            const size_t chroma = static_cast<size_t>(y / 2) * chroma_pitch + x / 2;
+            return rect_differs(cur + u_offset + chroma, old + u_offset + chroma, w / 2, h / 2, chroma_pitch)
+                || rect_differs(cur + v_offset + chroma, old + v_offset + chroma, w / 2, h / 2, chroma_pitch);
+        };
+
+        const auto upload = [&](const SDL_Rect& r) {
+            int ret;
+            if (format_ == output_format::yuv420) {
+                const size_t chroma = static_cast<size_t>(r.y / 2) * chroma_pitch + r.x / 2;
+                ret = SDL_UpdateYUVTexture(inst.texture.get(), &r, cur + r.y * pitch + r.x, pitch, cur + u_offset + chroma, chroma_pitch, cur + v_offset + chroma, chroma_pitch);
+            } else {
+                ret = SDL_UpdateTexture(inst.texture.get(), &r, cur + r.y * pitch + r.x * bpp, pitch);
+            }
+            if (ret)
+                throw_sdl_error("SDL_UpdateTexture");
+        };
+
+        bool changed = false;
+        for (int y = 0; y < screen_height; y += dirty_tile_size) {
+            const int h = std::min(dirty_tile_size, screen_height - y);
+            int run_start = -1;
+            for (int x = 0; x < screen_width; x += dirty_tile_size) {
+                if (dirty(x, y, std::min(dirty_tile_size, screen_width - x), h)) {
+                    if (run_start < 0)
+                        run_start = x;
+                } else if (run_start >= 0) {
+                    upload({ run_start, y, x - run_start, h });
+                    run_start = -1;
+                    changed = true;
+                }
+            }
+            if (run_start >= 0) {
+                upload({ run_start, y, screen_width - run_start, h });
+                changed = true;
+            }
+        }
+
+        // Clean tiles were identical, so the texture now holds exactly the staged frame
+        std::swap(inst.staging, inst.uploaded);
+        inst.texture_valid = true;
+        return changed;
+    }
+
+    // The weave functions write screen_height / 2 line pairs, taking top and bottom lines from two fields
+    // (which may be the same one). Source lines are HPIXELS apart and in RGBA32 byte order.
+    static void weave_rgba32(uint8_t* dest, int pitch, const uint32_t* top, const uint32_t* bottom)
+    {
+        for (int y = 0; y < screen_height / 2; ++y) {
+            std::memcpy(dest, top, screen_width * sizeof(uint32_t));
+            std::memcpy(dest + pitch, bottom, screen_width * sizeof(uint32_t));
+            dest += 2 * pitch;
+            top += HPIXELS;
+            bottom += HPIXELS;
+        }
+    }
+
+    static uint16_t to_rgb565(uint32_t c)
+    {
+        return static_cast<uint16_t>((c & 0xf8) << 8 | (c >> 5 & 0x7e0) | (c >> 19 & 0x1f));
+    }
+
+    static void weave_rgb565(uint8_t* dest, int pitch, const uint32_t* top, const uint32_t* bottom)
+    {
+        for (int y = 0; y < screen_height / 2; ++y) {
+            uint16_t* d1 = reinterpret_cast<uint16_t*>(dest);
+            uint16_t* d2 = reinterpret_cast<uint16_t*>(dest + pitch);
+            for (int x = 0; x < screen_width; ++x) {
+                d1[x] = to_rgb565(top[x]);
+                d2[x] = to_rgb565(bottom[x]);
+            }
+            dest += 2 * pitch;
+            top += HPIXELS;
+            bottom += HPIXELS;
+        }
+    }
+
+    // Planar IYUV (Y, then U and V at half resolution) as laid out by SDL_LockTexture, BT.601 limited range.
+    // Each woven line pair is exactly one row of 2x2 chroma blocks.
+    static void weave_yuv420(uint8_t* dest, int pitch, const uint32_t* top, const uint32_t* bottom)
+    {
+        const int chroma_pitch = (pitch + 1) / 2;
+        uint8_t* u = dest + pitch * screen_height;
+        uint8_t* v = u + chroma_pitch * (screen_height / 2);
+        const auto luma = [](int r, int g, int b) { return static_cast<uint8_t>(((66 * r + 129 * g + 25 * b + 128) >> 8) + 16); };
+
+        for (int y = 0; y < screen_height / 2; ++y) {
+            for (int x = 0; x < screen_width; x += 2) {
+                int rs = 0, gs = 0, bs = 0;
+                for (const auto& [src, row] : { std::pair { top, dest }, std::pair { bottom, dest + pitch } }) {
+                    for (int i = 0; i < 2; ++i) {
+                        const uint32_t c = src[x + i];
+                        const int r = c & 0xff, g = c >> 8 & 0xff, b = c >> 16 & 0xff;
+                        row[x + i] = luma(r, g, b);
+                        rs += r;
+                        gs += g;
+                        bs += b;
+                    }
+                }
+                // Sums of 4 pixels, so shift by 2 more to average
+                u[x / 2] = static_cast<uint8_t>(((-38 * rs - 74 * gs + 112 * bs + 512) >> 10) + 128);
+                v[x / 2] = static_cast<uint8_t>(((112 * rs - 94 * gs - 18 * bs + 512) >> 10) + 128);
+            }
+            dest += 2 * pitch;
+            u += chroma_pitch;
+            v += chroma_pitch;
+            top += HPIXELS;
+            bottom += HPIXELS;
+        }
+    }
+
+    uint32_t next_random()
+    {
+        noise_state_ ^= noise_state_ << 13;
+        noise_state_ ^= noise_state_ >> 17;
+        noise_state_ ^= noise_state_ << 5;
+        return noise_state_;
+    }
+
+    // Noise is generated once at field resolution (scaled to double height when drawn, like the emulator
+    // output) and animated by showing it from a random offset, which looks just as random.
+    void create_noise()
+    {
+        const int w = screen_width + noise_slack, h = screen_height / 2 + noise_slack;
+        noise_.reset(SDL_CreateTexture(renderer_.get(), SDL_PIXELFORMAT_RGBA32, SDL_TEXTUREACCESS_STATIC, w, h));
+        if (!noise_)
+            throw_sdl_error("SDL_CreateTexture");
+        std::vector<uint32_t> pixels(static_cast<size_t>(w) * h);
+        for (auto& p : pixels) {
+            const uint32_t r = static_cast<uint8_t>(next_random());
+            p = 0xff000000 | r << 16 | r << 8 | r;
+        }
+        if (SDL_UpdateTexture(noise_.get(), nullptr, pixels.data(), w * static_cast<int>(sizeof(uint32_t))))
+            throw_sdl_error("SDL_UpdateTexture");
+    }
+
+    void move_noise(instance& inst)
+    {
+        const uint32_t r = next_random();
+        inst.noise_src = { static_cast<int>(r % noise_slack), static_cast<int>((r >> 8) % noise_slack), screen_width, screen_height / 2 };
+        inst.last_buffer_pointer = nullptr;
+    }
+
+    // How long the main loop may block waiting for events. New frames have to be picked up while an instance
+    // is running, and a command batch being run has to be watched; otherwise only the overlay cursor blink,
+    // the noise animation and socket input are due. Emulator messages that change that (run, pause, power,
+    // abort) and batches from stdin wake the loop (see msg_queue_callback and command_channel::on_batch).
+    int wait_timeout() const
+    {
+        if (std::any_of(instances_.begin(), instances_.end(), [](const auto& inst) { return inst->power_is_on && (inst->running || inst->golden_hold || inst->held); }))
+            return 5;
+        if (commands_ && (!batch_.commands.empty() || commands_->has_output()))
+            return 5;
+        int timeout = idle_timeout;
+        if (overlay_active_)
+            timeout = 100;
+        // Socket and pty input can't wake the loop
+        if (stream_ || serial_ || (commands_ && commands_->polled()))
+            timeout = std::min(timeout, socket_poll_interval);
+        if (std::any_of(instances_.begin(), instances_.end(), [](const auto& inst) { return !inst->power_is_on; }))
+            timeout = std::min(timeout, static_cast<int>(noise_interval));
+        return timeout;
+    }
+
+    // Thread safe, code is the MsgType that calls for it or -1 for a command batch
+    void wake_main_loop(Sint32 code)
+    {
+        SDL_Event e {};
+        e.type = wake_event_;
+        e.user.code = code;
+        SDL_PushEvent(&e);
+    }
+
+    void render_instance(const instance& inst, const SDL_Rect* dst)
+    {
+        if (inst.power_is_on)
+            SDL_RenderCopy(renderer_.get(), inst.texture.get(), nullptr, dst);
+        else
+            SDL_RenderCopy(renderer_.get(), noise_.get(), &inst.noise_src, dst);
+    }
+
+    // Unchanged textures are just redrawn, scaling to the tile happens on the GPU
+    void render()
+    {
+        if (!tiled_) {
+            render_instance(*instances_[0], nullptr);
+        } else {
+            SDL_SetRenderDrawColor(renderer_.get(), 0, 0, 0, 255);
+            SDL_RenderClear(renderer_.get());
+            for (const auto& inst : instances_)
+                render_instance(*inst, &inst->tile);
+            SDL_SetRenderDrawColor(renderer_.get(), 255, 255, 255, 255);
+            SDL_RenderDrawRect(renderer_.get(), &focused().tile);
+        }
+        if (overlay_active_)
+            SDL_RenderCopy(renderer_.get(), overlay_.get(), nullptr, &focused().tile);
+        SDL_RenderPresent(renderer_.get());
+    }
 
     void capture_mouse(bool enabled)
     {
         if (enabled == mouse_captured_)
             return;
         SDL_SetRelativeMouseMode(enabled ? SDL_TRUE : SDL_FALSE);
-        SDL_SetWindowTitle(window_.get(), (std::string{"vAmiga"}+(enabled ? " - mouse captured" : "")).c_str());
         mouse_captured_ = enabled;
+        update_title();
+    }
+
+    void flush_mouse_motion()
+    {
+        if (!mouse_dx_ && !mouse_dy_)
+            return;
+        send_input([dx = mouse_dx_, dy = mouse_dy_](VAmiga& a) { a.controlPort1.mouse.setDxDy(dx, dy); });
+        mouse_dx_ = mouse_dy_ = 0;
+#ifndef WSL2_MOUSE_HACK
+        // Make sure mouse doesn't end up on the window border
+        int w, h;
+        SDL_GetWindowSize(window_.get(), &w, &h);
+        SDL_WarpMouseInWindow(window_.get(), w / 2, h / 2);
+#endif
+    }
+
+    // Latency test mode: measure from the host timestamp of an input event until SDL_RenderPresent returned for
+    // the first frame emulated entirely after the event was forwarded. That's event-to-present time, the
+    // display's own scanout and response time come on top. One probe is in flight at a time.
+    void start_latency_probe(uint32_t timestamp)
+    {
+        if (!latency_test_ || latency_probe_active_)
+            return;
+        latency_probe_active_ = true;
+        latency_probe_ticks_ = timestamp;
+        // The frame after the last completed one is already in progress and may or may not see the input
+        latency_probe_frame_ = focused().last_frame_nr + 2;
+    }
+
+    void finish_latency_probe()
+    {
+        if (!latency_probe_active_ || focused().last_frame_nr < latency_probe_frame_)
+            return;
+        latency_probe_active_ = false;
+        latency_results_.push_back(SDL_GetTicks() - latency_probe_ticks_);
+        if (latency_results_.size() < 10)
+            return;
+        uint32_t lo = UINT32_MAX, hi = 0, sum = 0;
+        for (const auto r : latency_results_) {
+            lo = std::min(lo, r);
+            hi = std::max(hi, r);
+            sum += r;
+        }
+        std::cout << "Event-to-present time over " << latency_results_.size() << " events: min " << lo << " ms, avg "
+                  << sum / latency_results_.size() << " ms, max " << hi << " ms\n";
+        latency_results_.clear();
+    }
+
+    enum : uint8_t {
+        joy_up = 1 << 0,
+        joy_down = 1 << 1,
+        joy_left = 1 << 2,
+        joy_right = 1 << 3,
+        joy_fire = 1 << 4,
+    };
+
+    static JoystickAPI& port_joystick(VAmiga& emulator, int port)
+    {
+        return port == 1 ? emulator.controlPort1.joystick : emulator.controlPort2.joystick;
+    }
+
+    // First controller goes in the joystick port (2), the next one in the mouse port
+    int free_controller_port() const
+    {
+        for (const int port : { 2, 1 }) {
+            if (std::none_of(controllers_.begin(), controllers_.end(), [port](const controller& c) { return c.port == port; }))
+                return port;
+        }
+        return 0;
+    }
+
+    void add_controller(int device_index)
+    {
+        SDL_GameController_ptr handle { SDL_GameControllerOpen(device_index) };
+        if (!handle) {
+            std::cerr << "SDL_GameControllerOpen failed: " << SDL_GetError() << "\n";
+            return;
+        }
+        const auto id = SDL_JoystickInstanceID(SDL_GameControllerGetJoystick(handle.get()));
+        if (std::any_of(controllers_.begin(), controllers_.end(), [id](const controller& c) { return c.id == id; }))
+            return;
+        const int port = free_controller_port();
+        std::cout << "Controller connected: " << SDL_GameControllerName(handle.get());
+        if (port)
+            std::cout << " (port " << port << ")";
+        std::cout << "\n";
+        controllers_.push_back({ std::move(handle), id, port, 0 });
+    }
+
+    void remove_controller(SDL_JoystickID id)
+    {
+        auto it = std::find_if(controllers_.begin(), controllers_.end(), [id](const controller& c) { return c.id == id; });
+        if (it == controllers_.end())
+            return;
+        const int port = it->port;
+        if (port) {
+            send_input([port](VAmiga& a) {
+                port_joystick(a, port).trigger(GamePadAction::RELEASE_XY);
+                port_joystick(a, port).trigger(GamePadAction::RELEASE_FIRE);
+            });
+        }
+        std::cout << "Controller disconnected\n";
+        controllers_.erase(it);
+        // Hand the port over to a controller that didn't get one
+        if (port) {
+            for (auto& c : controllers_) {
+                if (!c.port) {
+                    c.port = port;
+                    c.state = 0;
+                    break;
+                }
+            }
+        }
+    }
+
+    uint8_t read_controller(SDL_GameController* gc) const
+    {
+        const auto x = SDL_GameControllerGetAxis(gc, SDL_CONTROLLER_AXIS_LEFTX);
+        const auto y = SDL_GameControllerGetAxis(gc, SDL_CONTROLLER_AXIS_LEFTY);
+        uint8_t state = 0;
+        if (y < -joy_threshold_ || SDL_GameControllerGetButton(gc, SDL_CONTROLLER_BUTTON_DPAD_UP))
+            state |= joy_up;
+        else if (y > joy_threshold_ || SDL_GameControllerGetButton(gc, SDL_CONTROLLER_BUTTON_DPAD_DOWN))
+            state |= joy_down;
+        if (x < -joy_threshold_ || SDL_GameControllerGetButton(gc, SDL_CONTROLLER_BUTTON_DPAD_LEFT))
+            state |= joy_left;
+        else if (x > joy_threshold_ || SDL_GameControllerGetButton(gc, SDL_CONTROLLER_BUTTON_DPAD_RIGHT))
+            state |= joy_right;
+        for (const auto button : joy_fire_buttons_) {
+            if (SDL_GameControllerGetButton(gc, button))
+                state |= joy_fire;
+        }
+        return state;
+    }
+
+    // Sample all controllers (SDL_PumpEvents keeps their state current) and only forward what changed
+    void poll_controllers()
+    {
+        for (auto& c : controllers_) {
+            if (!c.port)
+                continue;
+            const uint8_t state = read_controller(c.handle.get());
+            if (state == c.state)
+                continue;
+            send_input([port = c.port, old_state = c.state, state](VAmiga& a) { update_joystick(port_joystick(a, port), old_state, state); });
+            c.state = state;
+        }
+    }
+
+    // Forwards the difference between two joy_* states
+    static void update_joystick(JoystickAPI& joystick, uint8_t old_state, uint8_t state)
+    {
+        const uint8_t changed = state ^ old_state;
+        if (changed & (joy_left | joy_right))
+            joystick.trigger(state & joy_left ? GamePadAction::PULL_LEFT : state & joy_right ? GamePadAction::PULL_RIGHT : GamePadAction::RELEASE_X);
+        if (changed & (joy_up | joy_down))
+            joystick.trigger(state & joy_up ? GamePadAction::PULL_UP : state & joy_down ? GamePadAction::PULL_DOWN : GamePadAction::RELEASE_Y);
+        if (changed & joy_fire)
+            joystick.trigger(state & joy_fire ? GamePadAction::PRESS_FIRE : GamePadAction::RELEASE_FIRE);
+    }
+
+    // The bridge is attached to the first instance so test harnesses don't depend on focus
+    void pump_serial()
+    {
+        VAmiga& emulator = instances_[0]->emulator;
+        // Everything the guest sent since the last iteration in one go
+        const auto out = emulator.serialPort.readOutgoing();
+        if (!out.empty()) {
+            std::string bytes(out.size(), '\0');
+            std::transform(out.begin(), out.end(), bytes.begin(), [](char16_t c) { return static_cast<char>(c & 0xff); });
+            serial_->write(bytes.data(), bytes.size());
+        }
+
+        serial_->pump();
+
+        if (serial_->pending_input()) {
+            std::string in(serial_->pending_input(), '\0');
+            in.resize(serial_->read(in.data(), in.size()));
+            emulator.serialPort << in;
+        }
+    }
+
+    // Input goes to the given instance, or in lockstep mode to every instance at the next barrier, where all of
+    // them are stopped after the same frame (see lockstep_sync)
+    template <typename F>
+    void send_input(VAmiga& target, F apply)
+    {
+        if (!lockstep_) {
+            apply(target);
+            return;
+        }
+        lockstep_inputs_.push_back(apply);
+    }
+
+    template <typename F>
+    void send_input(F apply)
+    {
+        send_input(emulator(), apply);
+    }
+
+    // Per new frame of each instance in lockstep mode
+    void lockstep_frame(instance& inst, isize nr)
+    {
+        const uint64_t video = lockstep_checker::hash_frame(&inst.current_frame[HPIXELS * ystart + xstart], xend - xstart, yend - ystart, HPIXELS);
+        lockstep_->submit(inst.index, static_cast<uint32_t>(nr), video);
+    }
+
+    // Once all instances are stopped after the same frame, input is applied and they continue (the ones behind
+    // catch up first). Returns true once the frame limit (-lockstep frames) has been reached.
+    bool lockstep_sync()
+    {
+        // Instances that are powered off don't take part
+        isize lo = std::numeric_limits<isize>::max(), hi = 0;
+        for (const auto& inst : instances_) {
+            if (inst->power_is_on) {
+                lo = std::min(lo, inst->last_frame_nr);
+                hi = std::max(hi, inst->last_frame_nr);
+            }
+        }
+        if (lo > hi)
+            return false;
+        if (std::all_of(instances_.begin(), instances_.end(), [](const auto& inst) { return inst->at_barrier || !inst->power_is_on; })) {
+            if (lo == hi) {
+                lockstep_audio(hi);
+                for (const auto& apply : lockstep_inputs_) {
+                    for (auto& inst : instances_)
+                        apply(inst->emulator);
+                }
+                lockstep_inputs_.clear();
+            }
+            for (auto& inst : instances_) {
+                if (inst->power_is_on && (lo == hi || inst->last_frame_nr < hi)) {
+                    inst->held = inst->at_barrier = false;
+                    inst->emulator.run();
+                }
+            }
+        }
+
+        // The emulator's CPU load is the busy fraction of its thread, time spent held back doesn't count
+        const auto now = SDL_GetTicks();
+        if (now - lockstep_stats_ticks_ >= 1000) {
+            const double elapsed = now - lockstep_stats_ticks_;
+            for (auto& inst : instances_) {
+                inst->busy_ms += inst->emulator.getStats().cpuLoad * elapsed;
+                inst->busy_frames += inst->last_frame_nr - inst->stats_frame;
+                inst->stats_frame = inst->last_frame_nr;
+            }
+            lockstep_stats_ticks_ = now;
+            if (++lockstep_reports_ % 10 == 0)
+                print_lockstep_times(lo);
+        }
+        return lockstep_frames_ && lo >= lockstep_frames_;
+    }
+
+    // The audio callback leaves the instances alone in lockstep mode: all of them are drained here by the same
+    // amount at the same frame, so what's taken only depends on what they emulated
+    void lockstep_audio(isize frame)
+    {
+        static constexpr size_t chunk = 1024; // Stereo samples
+        const isize frames = frame - lockstep_audio_frame_;
+        lockstep_audio_frame_ = frame;
+        if (frames <= 0 || !std::all_of(instances_.begin(), instances_.end(), [](const auto& inst) { return inst->power_is_on; }))
+            return;
+        lockstep_audio_.resize(chunk * 2);
+        for (auto& inst : instances_) {
+            for (size_t left = static_cast<size_t>(frames) * (audio_sample_rate / 50); left;) {
+                const size_t n = std::min(left, chunk);
+                inst->emulator.audioPort.copyInterleaved(lockstep_audio_.data(), n);
+                lockstep_->submit_audio(inst->index, lockstep_audio_.data(), n * 2);
+                left -= n;
+                if (stream_ && !inst->index) {
+                    std::lock_guard<std::mutex> lock { stream_audio_mutex_ };
+                    if (stream_audio_.free() >= n * 2 * sizeof(float))
+                        stream_audio_.push(lockstep_audio_.data(), n * 2 * sizeof(float));
+                }
+            }
+        }
+        lockstep_->check_audio(static_cast<uint32_t>(frame));
+    }
+
+    void print_lockstep_times(isize frame)
+    {
+        std::string line = "Lockstep: frame " + std::to_string(frame) + ", " + std::to_string(lockstep_->checked()) + " compared, host ms/frame:";
+        double first = 0;
+        for (const auto& inst : instances_) {
+            const double ms = inst->busy_frames ? inst->busy_ms / inst->busy_frames : 0;
+            char buf[64];
+            if (!inst->index || !first)
+                snprintf(buf, sizeof(buf), " #%d %.3f", inst->index + 1, ms);
+            else
+                snprintf(buf, sizeof(buf), " #%d %.3f (%+.1f%%)", inst->index + 1, ms, (ms / first - 1) * 100);
+            if (!inst->index)
+                first = ms;
+            line += buf;
+        }
+        std::cout << line << "\n";
+    }
+
+    int lockstep_finish(int result)
+    {
+        isize lo = instances_[0]->last_frame_nr;
+        for (const auto& inst : instances_)
+            lo = std::min(lo, inst->last_frame_nr);
+        print_lockstep_times(lo);
+        const int ret = lockstep_->finish();
+        return result ? result : ret;
+    }
+
+    // Like the serial bridge the stream is tied to the first instance. Its audio is collected by the audio
+    // callback, so it follows the sound card's clock (the dummy driver's with -headless), or by lockstep_audio.
+    void pump_stream()
+    {
+        {
+            std::vector<float> samples;
+            {
+                std::lock_guard<std::mutex> lock { stream_audio_mutex_ };
+                samples.resize(stream_audio_.size() / sizeof(float));
+                stream_audio_.pop(samples.data(), samples.size() * sizeof(float));
+            }
+            stream_->send_audio(samples.data(), samples.size() / 2);
+        }
+
+        stream_input_.clear();
+        stream_->pump(stream_input_);
+
+        // New clients get the latest field right away rather than with the next emulated frame, which may never
+        // come (paused or powered off). After update_frame's swap that's last_frame.
+        const instance& inst = *instances_[0];
+        stream_->send_key_frame(static_cast<uint32_t>(inst.last_frame_nr), &inst.last_frame[HPIXELS * ystart + HBLANK_MAX * 4], HPIXELS);
+
+        VAmiga& emulator = instances_[0]->emulator;
+        for (const auto& e : stream_input_) {
+            if (e.type == stream::msg_key) {
+                send_input(emulator, [e](VAmiga& a) {
+                    if (e.value)
+                        a.keyboard.press(e.code);
+                    else
+                        a.keyboard.release(e.code);
+                });
+            } else if (e.type == stream::msg_mouse) {
+                send_input(emulator, [e, old_buttons = stream_mouse_buttons_](VAmiga& a) {
+                    auto& mouse = a.controlPort1.mouse;
+                    if (e.dx || e.dy)
+                        mouse.setDxDy(e.dx, e.dy);
+                    const uint8_t changed = e.value ^ old_buttons;
+                    if (changed & 1)
+                        mouse.trigger(e.value & 1 ? GamePadAction::PRESS_LEFT : GamePadAction::RELEASE_LEFT);
+                    if (changed & 2)
+                        mouse.trigger(e.value & 2 ? GamePadAction::PRESS_RIGHT : GamePadAction::RELEASE_RIGHT);
+                });
+                stream_mouse_buttons_ = e.value;
+            } else if (e.type == stream::msg_joystick) {
+                send_input(emulator, [old_state = stream_joystick_, state = e.value](VAmiga& a) { update_joystick(a.controlPort2.joystick, old_state, state); });
+                stream_joystick_ = e.value;
+            }
+        }
+    }
+
+    static std::string last_line(const std::string& text)
+    {
+        const auto pos = text.find_last_of('\n');
+        return pos == std::string::npos ? text : text.substr(pos + 1);
+    }
+
+    // Length of the retro shell prompt at the start of line, 0 if there's none. It's a word ending in '>', '%'
+    // or '$' (depending on the shell mode) and a space, what follows is input typed in the overlay.
+    static size_t prompt_length(const std::string& line)
+    {
+        const auto pos = line.find(' ');
+        return pos != std::string::npos && pos && strchr(">%$", line[pos - 1]) ? pos + 1 : 0;
+    }
+
+    // Where the text the shell added since before (ending in a prompt line at line_start) starts in text. Once
+    // the console is full its oldest lines are dropped, so it's found by the content preceding that prompt.
+    static size_t added_text_start(const std::string& text, const std::string& before, size_t line_start, const std::string& command)
+    {
+        static constexpr size_t anchor_length = 1024;
+        const size_t n = std::min(line_start, anchor_length);
+        const auto pos = text.rfind(before.c_str() + line_start - n, line_start - n, n);
+        if (pos != std::string::npos)
+            return pos + n;
+        // More was added than the console holds: start at the last echo of the command
+        for (size_t end = text.size(); end;) {
+            const auto nl = text.rfind('\n', end - 1);
+            const size_t start = nl == std::string::npos ? 0 : nl + 1;
+            const std::string line = text.substr(start, end - start);
+            if (const size_t p = prompt_length(line); p && line.compare(p, std::string::npos, command) == 0)
+                return start;
+            end = start ? start - 1 : 0;
+        }
+        return 0;
+    }
+
+    // Status and completion are inferred (replies say so), a command prefixed with "@n " runs on instance n
+    void pump_commands()
+    {
+        static constexpr uint32_t command_timeout = 10000; // ms
+        // Retro shell error messages (there's no status code)
+        static constexpr const char* error_markers[] = { "Error", "error:", "not found", "Syntax error", "Too few arguments", "Too many arguments" };
+
+        commands_->pump();
+        auto& b = batch_;
+        if (b.commands.empty()) {
+            if (!commands_->next_batch(b.commands))
+                return;
+            ++b.id;
+            b.next = 0;
+            b.errors = 0;
+            b.start_ticks = SDL_GetTicks();
+        }
+
+        if (b.busy) {
+            const std::string text { b.target->emulator.retroShell.text() };
+            const bool timeout = SDL_GetTicks() - b.command_ticks >= command_timeout;
+            const std::string& command = b.commands[b.next];
+            std::string output = text.substr(added_text_start(text, b.text_before, b.line_start, command));
+            // Done once a new line starts with a prompt (not necessarily the old one, e.g. in the debugger)
+            const bool done = output.find('\n') != std::string::npos && prompt_length(last_line(output));
+            if (!timeout && !done)
+                return;
+
+            if (done)
+                output.erase(output.find_last_of('\n') + 1); // The new prompt
+            // The line the command was started on, i.e. the old prompt and the echo
+            const auto eol = output.find('\n');
+            output.erase(0, eol == std::string::npos ? eol : eol + 1);
+            while (!output.empty() && (output.back() == '\n' || output.back() == ' '))
+                output.pop_back();
+
+            const char* status = "ok";
+            if (timeout)
+                status = "timeout";
+            else if (std::any_of(std::begin(error_markers), std::end(error_markers), [&](const char* m) { return output.find(m) != std::string::npos; }))
+                status = "error";
+            if (strcmp(status, "ok"))
+                ++b.errors;
+            commands_->reply("{\"batch\":" + std::to_string(b.id) + ",\"index\":" + std::to_string(b.next) + ",\"instance\":" + std::to_string(b.target->index + 1)
+                + ",\"command\":" + json_string(command) + ",\"status\":\"" + status + "\",\"status_inferred\":" + (timeout ? "false" : "true")
+                + ",\"output\":" + json_string(output) + "}");
+            b.busy = false;
+            ++b.next;
+        }
+
+        if (b.next == b.commands.size()) {
+            commands_->reply("{\"batch\":" + std::to_string(b.id) + ",\"done\":true,\"commands\":" + std::to_string(b.commands.size())
+                + ",\"errors\":" + std::to_string(b.errors) + ",\"ms\":" + std::to_string(SDL_GetTicks() - b.start_ticks) + "}");
+            b.commands.clear();
+            return;
+        }
+
+        std::string& command = b.commands[b.next];
+        b.target = instances_[0].get();
+        if (command[0] == '@') {
+            const auto space = command.find(' ');
+            const int n = atoi(command.c_str() + 1);
+            if (n >= 1 && n <= static_cast<int>(instances_.size()) && space != std::string::npos) {
+                b.target = instances_[n - 1].get();
+                command.erase(0, space + 1);
+            }
+        }
+        auto& rs = b.target->emulator.retroShell;
+        b.text_before = rs.text();
+        b.line_start = b.text_before.size() - last_line(b.text_before).size();
+        b.command_ticks = SDL_GetTicks();
+        b.busy = true;
+        rs.execScript(command);
     }
 
-    void msg_queue_callback(Message msg)
+    void msg_queue_callback(instance& inst, Message msg)
     {
         switch (msg.type) {
             case MsgType::RSH_UPDATE:
+                // Redraw the retro shell (if open) right away rather than at the next blink
+                wake_main_loop(static_cast<Sint32>(msg.type));
+                return;
             case MsgType::RSH_DEBUGGER:
             case MsgType::DRIVE_SELECT:
             case MsgType::DRIVE_STEP:
@@ -579,6 +1629,7 @@ private:
             case MsgType::DRIVE_LED:
             case MsgType::DRIVE_MOTOR:
             case MsgType::SER_IN:
+            case MsgType::SER_OUT:
             case MsgType::HDR_READ:
             case MsgType::HDR_WRITE:
             case MsgType::HDR_IDLE:
@@ -596,22 +1647,29 @@ private:
             case MsgType::VIDEO_FORMAT:
             case MsgType::DMA_DEBUG:
             case MsgType::MUTE:
+            case MsgType::RESET:
+                return;
             case MsgType::RUN:
             case MsgType::PAUSE:
-            case MsgType::RESET:
+                inst.running = msg.type == MsgType::RUN;
+                wake_main_loop(static_cast<Sint32>(msg.type));
                 return;
             case MsgType::ABORT:
-                abort_ = msg.value | 0x100;
-                power_is_on_ = false;
+                inst.abort = msg.value | 0x100;
+                inst.power_is_on = false;
+                wake_main_loop(static_cast<Sint32>(msg.type));
                 break;
             case MsgType::POWER:
                 if (msg.value) {
-                    power_is_on_ = true;
+                    inst.power_is_on = true;
+                    inst.powered_on = true;
                 } else {
-                    power_is_on_ = false;
-                    std::memset(&current_frame_[0], 0, sizeof(uint32_t)*current_frame_.size());
-                    std::memset(&last_frame_[0], 0, sizeof(uint32_t)*last_frame_.size());
+                    inst.power_is_on = false;
+                    inst.running = false;
+                    std::memset(&inst.current_frame[0], 0, sizeof(uint32_t)*inst.current_frame.size());
+                    std::memset(&inst.last_frame[0], 0, sizeof(uint32_t)*inst.last_frame.size());
                 }
+                wake_main_loop(static_cast<Sint32>(msg.type));
                 return;
 
 //            case MsgType::CLOSE_CONSOLE:
@@ -622,31 +1680,39 @@ private:
 //                return;
             case MsgType::RECORDING_STOPPED:
 #ifdef SCREEN_RECORDER
-                amiga_.denise.screenRecorder.exportAs("test.mp4");
+                inst.amiga.denise.screenRecorder.exportAs("test.mp4");
 #endif
                 std::cout << "Recording exported\n";
                 break;
-//            case MsgType::SER_OUT:
-//                if ((data1 & 0xff) != '\n') {
-//                    ser_buffer_.push_back(static_cast<char>(data1 & 0xff));
-//                    return;
-//                }
-//                while (!ser_buffer_.empty() && ser_buffer_.back() == '\r')
-//                    ser_buffer_.pop_back();
-//                std::cout << "Serial data: \"" << ser_buffer_.c_str() << "\"\n";
-//                ser_buffer_.clear();
-//                return;
             default:
                break;
         }
-	std::cerr << "MsgQueue: type=" << (long)msg.type
+	std::cerr << "MsgQueue" << (tiled_ ? "[" + std::to_string(inst.index + 1) + "]" : "") << ": type=" << (long)msg.type
 		  << "(" << MsgTypeEnum::key(msg.type)
 		  << ") value=" << msg.value << "\n";
     }
 
     void audio_callback(Uint8* stream, int len)
     {
-        emulator_.audioPort.copyInterleaved(reinterpret_cast<float*>(stream), len / (2 * sizeof(float)));
+        if (lockstep_) { // The instances are drained by lockstep_audio, they're muted
+            memset(stream, 0, len);
+            return;
+        }
+        const size_t focus = focus_;
+        instances_[focus]->emulator.audioPort.copyInterleaved(reinterpret_cast<float*>(stream), len / (2 * sizeof(float)));
+        if (!stream_)
+            return;
+        // The stream carries the first instance, which nobody hears while another one has focus
+        const void* samples = stream;
+        if (focus) {
+            stream_scratch_.resize(len / sizeof(float));
+            instances_[0]->emulator.audioPort.copyInterleaved(stream_scratch_.data(), len / (2 * sizeof(float)));
+            samples = stream_scratch_.data();
+        }
+        // Whole buffers only, the main loop drains it long before it fills up
+        std::lock_guard<std::mutex> lock { stream_audio_mutex_ };
+        if (stream_audio_.free() >= static_cast<size_t>(len))
+            stream_audio_.push(samples, static_cast<size_t>(len));
     }
 
     static constexpr int char_scale = 1;
@@ -696,20 +1762,33 @@ private:
         }
     }
 
-    void update_overlay()
+    // Returns true if the overlay was redrawn
+    bool update_overlay()
     {
         if (!overlay_dirty_) {
             const auto now = SDL_GetTicks();
             if (now - last_overlay_blink_ < 100)
-                return;
+                return false;
             last_overlay_blink_ = now;
         }
 
         // Hmm...
         std::vector<std::string> lines;
-        std::istringstream iss { emulator_.retroShell.text() };
-        for (std::string line; std::getline(iss, line);)
-            lines.push_back(line);
+        if (show_profile_) {
+            // Symbol resolution isn't free, so don't redo the report on every blink
+            const auto now = SDL_GetTicks();
+            if (profile_lines_.empty() || now - last_profile_update_ >= 1000) {
+                profile_lines_ = profiler_->report();
+                profile_lines_.push_back("");
+                profile_lines_.push_back("F1: Back to shell  F2: Write flamegraph data");
+                last_profile_update_ = now;
+            }
+            lines = profile_lines_;
+        } else {
+            std::istringstream iss { emulator().retroShell.text() };
+            for (std::string line; std::getline(iss, line);)
+                lines.push_back(line);
+        }
 
         void* pixels;
         int pitch;
@@ -731,8 +1810,8 @@ private:
             y += char_height;
         }
 
-        if (!overlay_blink_ && !lines.empty()) {
-            const auto cpos = static_cast<int>(emulator_.retroShell.cursorRel() + lines.back().length());
+        if (!overlay_blink_ && !show_profile_ && !lines.empty()) {
+            const auto cpos = static_cast<int>(emulator().retroShell.cursorRel() + lines.back().length());
             if ((cpos + 1) * char_width < screen_width)
                 draw_cursor(pixels, pitch, cpos * char_width, y - char_height, 0xffffffff);
         }
@@ -740,6 +1819,99 @@ private:
         SDL_UnlockTexture(overlay_.get());
         overlay_dirty_ = false;
         overlay_blink_ = !overlay_blink_;
+        return true;
+    }
+
+    void paste_clipboard()
+    {
+        std::unique_ptr<char, sdl_freer> text { SDL_GetClipboardText() };
+        if (text && *text)
+            type_text(focused(), text.get(), 0);
+    }
+
+    // Queues text to be typed on the guest keyboard once the instance reaches start_frame
+    void type_text(instance& inst, const std::string& text, isize start_frame)
+    {
+        if (typing_.target && typing_.target != &inst) {
+            std::cerr << "Still typing into instance " << typing_.target->index + 1 << "\n";
+            return;
+        }
+        size_t skipped = 0;
+        for (const char c : text) {
+            uint8_t code;
+            bool shift;
+            if (c == '\r')
+                continue;
+            if (char_to_key(c, code, shift)) {
+                typing_.keys.push_back({ code, shift });
+                ++typing_.total;
+            } else
+                ++skipped;
+        }
+        if (skipped)
+            std::cerr << "Typing: skipped " << skipped << " characters without a key\n";
+        if (typing_.keys.empty())
+            return;
+        if (!typing_.target) {
+            typing_.target = &inst;
+            typing_.start_frame = start_frame;
+        }
+    }
+
+    // Called for every new frame of the target. Each key is a press and a release, plus those of shift if
+    // needed, and the keyboard hands them to the guest one at a time with a handshake, so at most
+    // max_codes_per_frame events are queued per frame: one shifted key, or up to two others once a line is
+    // going. After a newline the guest gets a few frames to act on it before typing continues slowly again.
+    // Warp is on meanwhile, so the wait is short in host time.
+    void type_keys(instance& inst)
+    {
+        static constexpr int max_codes_per_frame = 4;
+        static constexpr int newline_pause = 10;
+        auto& t = typing_;
+        if (inst.last_frame_nr < t.start_frame)
+            return;
+        if (!t.started) {
+            t.started = true;
+            t.start_ticks = SDL_GetTicks();
+            if (!lockstep_ && !golden_) // It would only be held back, or golden frames could be skipped
+                inst.emulator.warpOn();
+        }
+        if (t.pause) {
+            --t.pause;
+            return;
+        }
+        if (t.keys.empty()) {
+            if (!lockstep_ && !golden_)
+                inst.emulator.warpOff();
+            std::cout << "Sent " << t.total << " characters to the keyboard in " << SDL_GetTicks() - t.start_ticks << " ms\n";
+            t = typing_state {};
+            return;
+        }
+
+        const int budget = std::min(max_codes_per_frame, 2 + t.since_newline / 8);
+        for (int codes = 0; !t.keys.empty();) {
+            const auto k = t.keys.front();
+            const int cost = k.shift ? 4 : 2;
+            if (codes && codes + cost > budget)
+                break;
+            codes += cost;
+            t.keys.pop_front();
+            // Pressed and released right away, the keyboard queues the events in order
+            send_input(inst.emulator, [k](VAmiga& a) {
+                if (k.shift)
+                    a.keyboard.press(amiga_key_left_shift);
+                a.keyboard.press(k.code);
+                a.keyboard.release(k.code);
+                if (k.shift)
+                    a.keyboard.release(amiga_key_left_shift);
+            });
+            if (k.code == amiga_key_return) {
+                t.since_newline = 0;
+                t.pause = newline_pause;
+                break;
+            }
+            ++t.since_newline;
+        }
     }
 
     void handle_overlay_mouse(const SDL_MouseButtonEvent& b)
@@ -748,7 +1920,7 @@ private:
             // Paste
             std::unique_ptr<char, sdl_freer> text{SDL_GetClipboardText()};
             if (text) {
-                emulator_.retroShell.press(text.get());
+                emulator().retroShell.press(text.get());
             }
         }
     }
@@ -757,12 +1929,12 @@ private:
     {
         // TODO: Shift+Enter
         assert(overlay_active_);
-        auto& rs = emulator_.retroShell;
+        auto& rs = emulator().retroShell;
         switch (k.sym) {
         case SDLK_ESCAPE:
         case SDLK_F12:
             overlay_active_ = false;
-            last_buffer_pointer_ = nullptr; // Force update (dirty)
+            force_render_ = true; // The frame itself may not change
             break;
         case SDLK_UP:
             rs.press(RetroShellKey::UP);
@@ -794,6 +1966,24 @@ private:
         case SDLK_RETURN:
             rs.press(RetroShellKey::RETURN);
             break;
+        case SDLK_F1:
+            if (!profiler_) {
+                std::cout << "Profiler not active (start with -profile [frames])\n";
+                return;
+            }
+            show_profile_ = !show_profile_;
+            profile_lines_.clear();
+            overlay_dirty_ = true;
+            break;
+        case SDLK_F2:
+            if (profiler_) {
+                const auto filename = timestamped_filename("profile", "folded");
+                std::cout << "Writing profile to " << filename << "\n";
+                profiler_->write_folded(filename);
+                for (const auto& l : profiler_->report())
+                    std::cout << l << "\n";
+            }
+            break;
         default:
             if (k.sym >= SDLK_a && k.sym <= SDLK_z) {
                 const char ch = static_cast<char>((k.sym-SDLK_a) + (k.mod & KMOD_SHIFT ? 'A' : 'a'));
@@ -813,27 +2003,29 @@ private:
 
     bool handle_joystick_key(SDL_Keycode key, bool up)
     {
-        auto& joystick = emulator_.controlPort2.joystick;
+        GamePadAction action;
         switch (key) {
         case SDLK_KP_0:
         case SDLK_KP_5:
-            joystick.trigger(up ? GamePadAction::RELEASE_FIRE : GamePadAction::PRESS_FIRE);
-            return true;
+            action = up ? GamePadAction::RELEASE_FIRE : GamePadAction::PRESS_FIRE;
+            break;
         case SDLK_KP_8:
-            joystick.trigger(up ? GamePadAction::RELEASE_Y : GamePadAction::PULL_UP);
-            return true;
+            action = up ? GamePadAction::RELEASE_Y : GamePadAction::PULL_UP;
+            break;
         case SDLK_KP_2:
-            joystick.trigger(up ? GamePadAction::RELEASE_Y : GamePadAction::PULL_DOWN);
-            return true;
+            action = up ? GamePadAction::RELEASE_Y : GamePadAction::PULL_DOWN;
+            break;
         case SDLK_KP_4:
-            joystick.trigger(up ? GamePadAction::RELEASE_X : GamePadAction::PULL_LEFT);
-            return true;
+            action = up ? GamePadAction::RELEASE_X : GamePadAction::PULL_LEFT;
+            break;
         case SDLK_KP_6:
-            joystick.trigger(up ? GamePadAction::RELEASE_X : GamePadAction::PULL_RIGHT);
-            return true;
+            action = up ? GamePadAction::RELEASE_X : GamePadAction::PULL_RIGHT;
+            break;
         default:
             return false;
         }
+        send_input([action](VAmiga& a) { a.controlPort2.joystick.trigger(action); });
+        return true;
     }
 };
 
@@ -841,6 +2033,17 @@ int main(int argc, char* argv[])
 {
     std::ios::sync_with_stdio(true);
     try {
+        // Before the driver sees the arguments: SDL picks its drivers when it's initialized, and stdout has to be
+        // reserved before anything is printed
+        for (int i = 1; i < argc; ++i) {
+            if (!strcmp(argv[i], "-headless")) {
+                SDL_setenv("SDL_VIDEODRIVER", "dummy", 1);
+                SDL_setenv("SDL_AUDIODRIVER", "dummy", 1);
+            } else if (!strcmp(argv[i], "-cmd") && i + 1 < argc && !strcmp(argv[i + 1], "stdin")) {
+                command_channel::reserve_stdout();
+            }
+        }
+
         driver d;
         return d.run(argc, argv);
 
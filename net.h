@@ -0,0 +1,229 @@
+#ifndef NET_H
+#define NET_H
+
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <utility>
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <arpa/inet.h>
+#include <cerrno>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+// Minimal non-blocking TCP sockets for the loopback services (serial bridge etc.)
+
+#ifdef _WIN32
+using socket_t = SOCKET;
+constexpr socket_t invalid_socket = INVALID_SOCKET;
+#else
+using socket_t = int;
+constexpr socket_t invalid_socket = -1;
+#endif
+
+[[noreturn]] inline void throw_net_error(const std::string& what)
+{
+#ifdef _WIN32
+    const int err = WSAGetLastError();
+#else
+    const int err = errno;
+#endif
+    throw std::runtime_error { what + " failed: error " + std::to_string(err) };
+}
+
+// A port number given on the command line, 1-65535
+inline uint16_t parse_port(const std::string& s)
+{
+    size_t end = 0;
+    unsigned long port = 0;
+    try {
+        port = std::stoul(s, &end);
+    } catch (const std::exception&) {
+    }
+    if (end != s.size() || !port || port > 65535)
+        throw std::runtime_error { "Invalid port: " + s };
+    return static_cast<uint16_t>(port);
+}
+
+class net_init {
+public:
+    net_init()
+    {
+#ifdef _WIN32
+        WSADATA wsa;
+        if (WSAStartup(MAKEWORD(2, 2), &wsa))
+            throw std::runtime_error { "WSAStartup failed" };
+#endif
+    }
+
+    net_init(const net_init&) = delete;
+    net_init& operator=(const net_init&) = delete;
+
+    ~net_init()
+    {
+#ifdef _WIN32
+        WSACleanup();
+#endif
+    }
+};
+
+class tcp_socket {
+public:
+    tcp_socket() = default;
+
+    explicit tcp_socket(socket_t s)
+        : s_ { s }
+    {
+    }
+
+    tcp_socket(tcp_socket&& other) noexcept
+        : s_ { std::exchange(other.s_, invalid_socket) }
+    {
+    }
+
+    tcp_socket& operator=(tcp_socket&& other) noexcept
+    {
+        if (this != &other) {
+            close();
+            s_ = std::exchange(other.s_, invalid_socket);
+        }
+        return *this;
+    }
+
+    ~tcp_socket()
+    {
+        close();
+    }
+
+    explicit operator bool() const
+    {
+        return s_ != invalid_socket;
+    }
+
+    void close()
+    {
+        if (s_ == invalid_socket)
+            return;
+#ifdef _WIN32
+        closesocket(s_);
+#else
+        ::close(s_);
+#endif
+        s_ = invalid_socket;
+    }
+
+    // Non-blocking listener on 127.0.0.1
+    static tcp_socket listen(uint16_t port)
+    {
+        tcp_socket s { ::socket(AF_INET, SOCK_STREAM, IPPROTO_TCP) };
+        if (!s)
+            throw_net_error("socket");
+        int one = 1;
+        setsockopt(s.s_, SOL_SOCKET, SO_REUSEADDR, reinterpret_cast<const char*>(&one), sizeof(one));
+        sockaddr_in addr {};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        addr.sin_port = htons(port);
+        if (::bind(s.s_, reinterpret_cast<const sockaddr*>(&addr), sizeof(addr)))
+            throw_net_error("bind to port " + std::to_string(port));
+        if (::listen(s.s_, 4))
+            throw_net_error("listen");
+        s.set_nonblocking();
+        return s;
+    }
+
+    // Blocking connect, the socket is non-blocking afterwards
+    static tcp_socket connect(const std::string& host, uint16_t port)
+    {
+        tcp_socket s { ::socket(AF_INET, SOCK_STREAM, IPPROTO_TCP) };
+        if (!s)
+            throw_net_error("socket");
+        sockaddr_in addr {};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port);
+        if (inet_pton(AF_INET, host.c_str(), &addr.sin_addr) != 1)
+            throw std::runtime_error { "Invalid address: " + host };
+        if (::connect(s.s_, reinterpret_cast<const sockaddr*>(&addr), sizeof(addr)))
+            throw_net_error("connect to " + host + ":" + std::to_string(port));
+        s.set_nonblocking();
+        s.set_nodelay();
+        return s;
+    }
+
+    // Returns an empty socket if no connection is pending
+    tcp_socket accept()
+    {
+        tcp_socket c { ::accept(s_, nullptr, nullptr) };
+        if (c) {
+            c.set_nonblocking();
+            c.set_nodelay();
+        }
+        return c;
+    }
+
+    // Returns the number of bytes transferred, 0 if the call would block and -1 if the connection is gone
+    ptrdiff_t send(const void* data, size_t len)
+    {
+#ifdef _WIN32
+        const int n = ::send(s_, static_cast<const char*>(data), static_cast<int>(len), 0);
+#else
+        const ssize_t n = ::send(s_, data, len, MSG_NOSIGNAL);
+#endif
+        if (n >= 0)
+            return n;
+        return would_block() ? 0 : -1;
+    }
+
+    ptrdiff_t recv(void* data, size_t len)
+    {
+#ifdef _WIN32
+        const int n = ::recv(s_, static_cast<char*>(data), static_cast<int>(len), 0);
+#else
+        const ssize_t n = ::recv(s_, data, len, 0);
+#endif
+        if (n > 0)
+            return n;
+        if (n == 0)
+            return -1; // Orderly shutdown
+        return would_block() ? 0 : -1;
+    }
+
+private:
+    socket_t s_ = invalid_socket;
+
+    void set_nonblocking()
+    {
+#ifdef _WIN32
+        u_long mode = 1;
+        ioctlsocket(s_, FIONBIO, &mode);
+#else
+        fcntl(s_, F_SETFL, fcntl(s_, F_GETFL) | O_NONBLOCK);
+#endif
+    }
+
+    void set_nodelay()
+    {
+        int one = 1;
+        setsockopt(s_, IPPROTO_TCP, TCP_NODELAY, reinterpret_cast<const char*>(&one), sizeof(one));
+    }
+
+    static bool would_block()
+    {
+#ifdef _WIN32
+        return WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+        return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+#endif
+    }
+};
+
+#endif
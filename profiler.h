@@ -0,0 +1,296 @@
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#ifdef __linux__
+#include <csignal>
+#include <cstdlib>
+#include <cxxabi.h>
+#include <dlfcn.h>
+#include <sys/time.h>
+#include <ucontext.h>
+#endif
+
+// Statistical profiler attributing host CPU time to emulator subsystems.
+//
+// SIGPROF fires per N us of *process* CPU time and is delivered to the thread that consumed it, so each
+// sample is one period of host time spent in whatever the program counter points at. Samples are tagged
+// with the emulated frame number; symbols are only resolved (and cached) when a report is requested.
+// The executable must export its symbols (-rdynamic) for dladdr to see into the emulator core.
+class profiler {
+public:
+    enum class zone { cpu, agnus, denise, paula, disk, memory, core, frontend, other, count };
+
+    static const char* zone_name(zone z)
+    {
+        switch (z) {
+        case zone::cpu: return "CPU";
+        case zone::agnus: return "Agnus";
+        case zone::denise: return "Denise";
+        case zone::paula: return "Paula";
+        case zone::disk: return "Disk";
+        case zone::memory: return "Memory";
+        case zone::core: return "Core";
+        case zone::frontend: return "Frontend";
+        default: return "Other";
+        }
+    }
+
+    static constexpr bool supported()
+    {
+#ifdef __linux__
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    explicit profiler(uint32_t window_frames, int period_us = 1000)
+        : window_ { std::max(window_frames, 1U) }
+        , period_us_ { period_us }
+        , samples_(max_samples)
+    {
+#ifdef __linux__
+        if (active_)
+            throw std::runtime_error { "Only one profiler can be active" };
+        active_ = this;
+
+        struct sigaction sa {};
+        sa.sa_sigaction = &on_sigprof;
+        sa.sa_flags = SA_SIGINFO | SA_RESTART;
+        sigemptyset(&sa.sa_mask);
+        if (sigaction(SIGPROF, &sa, &old_action_))
+            throw std::runtime_error { "sigaction(SIGPROF) failed" };
+
+        itimerval tv {};
+        tv.it_interval.tv_usec = period_us_;
+        tv.it_value.tv_usec = period_us_;
+        if (setitimer(ITIMER_PROF, &tv, nullptr))
+            throw std::runtime_error { "setitimer(ITIMER_PROF) failed" };
+#endif
+    }
+
+    profiler(const profiler&) = delete;
+    profiler& operator=(const profiler&) = delete;
+
+    ~profiler()
+    {
+#ifdef __linux__
+        itimerval tv {};
+        setitimer(ITIMER_PROF, &tv, nullptr);
+        sigaction(SIGPROF, &old_action_, nullptr);
+        active_ = nullptr;
+#endif
+    }
+
+    // Called by the frontend whenever it sees a new emulated frame
+    void frame(uint32_t nr)
+    {
+        frame_.store(nr, std::memory_order_relaxed);
+    }
+
+    uint32_t window() const
+    {
+        return window_;
+    }
+
+    // Per-zone summary over the last window_ frames, one line per zone
+    std::vector<std::string> report()
+    {
+        std::vector<std::string> lines;
+        if (!supported()) {
+            lines.push_back("Profiling is not supported on this platform");
+            return lines;
+        }
+
+        std::array<uint64_t, static_cast<size_t>(zone::count)> counts {};
+        uint64_t total = 0;
+        const uint32_t frames = for_each_sample([&](const symbol& s, uint64_t count) {
+            counts[static_cast<size_t>(s.z)] += count;
+            total += count;
+        });
+
+        char buf[128];
+        snprintf(buf, sizeof(buf), "Profile: %u frames, %llu samples @ %d us", frames, static_cast<unsigned long long>(total), period_us_);
+        lines.push_back(buf);
+        lines.push_back("");
+        for (size_t z = 0; z < counts.size(); ++z) {
+            if (!counts[z])
+                continue;
+            const double pct = 100.0 * counts[z] / total;
+            const double ms_per_frame = frames ? counts[z] * period_us_ / 1000.0 / frames : 0.0;
+            snprintf(buf, sizeof(buf), "%-9s %5.1f%% %7.2f ms/frame", zone_name(static_cast<zone>(z)), pct, ms_per_frame);
+            lines.push_back(buf);
+        }
+        return lines;
+    }
+
+    // Writes the current window as folded stacks ("zone;function count"), the input format of flamegraph.pl
+    void write_folded(const std::string& filename)
+    {
+        std::map<std::string, uint64_t> stacks;
+        for_each_sample([&](const symbol& s, uint64_t count) {
+            stacks[std::string { zone_name(s.z) } + ";" + s.name] += count;
+        });
+
+        std::ofstream out { filename };
+        if (!out)
+            throw std::runtime_error { "Error creating " + filename };
+        for (const auto& [stack, count] : stacks)
+            out << stack << " " << count << "\n";
+    }
+
+private:
+    struct sample {
+        uintptr_t pc;
+        uint32_t frame;
+    };
+
+    struct symbol {
+        std::string name;
+        zone z;
+    };
+
+    static constexpr uint32_t max_samples = 1 << 16;
+    static inline profiler* active_ = nullptr;
+
+    const uint32_t window_;
+    const int period_us_;
+    std::atomic<uint32_t> frame_ { 0 };
+    std::atomic<uint32_t> head_ { 0 };
+    std::vector<sample> samples_;
+    std::unordered_map<uintptr_t, std::shared_ptr<symbol>> pc_cache_;
+    std::unordered_map<uintptr_t, std::shared_ptr<symbol>> func_cache_;
+#ifdef __linux__
+    struct sigaction old_action_ {};
+
+    static void on_sigprof(int, siginfo_t*, void* ctx)
+    {
+        profiler* p = active_;
+        if (!p)
+            return;
+        const auto uc = static_cast<const ucontext_t*>(ctx);
+#if defined(__x86_64__)
+        const auto pc = static_cast<uintptr_t>(uc->uc_mcontext.gregs[REG_RIP]);
+#elif defined(__i386__)
+        const auto pc = static_cast<uintptr_t>(uc->uc_mcontext.gregs[REG_EIP]);
+#elif defined(__aarch64__)
+        const auto pc = static_cast<uintptr_t>(uc->uc_mcontext.pc);
+#else
+        const uintptr_t pc = 0;
+        (void)uc;
+#endif
+        const auto idx = p->head_.fetch_add(1, std::memory_order_relaxed);
+        p->samples_[idx % max_samples] = { pc, p->frame_.load(std::memory_order_relaxed) };
+    }
+#endif
+
+    // Calls f(symbol, count) for samples in the window, returns the number of frames covered
+    template <typename F>
+    uint32_t for_each_sample(F f)
+    {
+        const uint32_t now = frame_.load(std::memory_order_relaxed);
+        const uint32_t first = now > window_ ? now - window_ : 0;
+        const uint32_t head = head_.load(std::memory_order_relaxed);
+        const uint32_t count = std::min(head, max_samples);
+
+        std::unordered_map<uintptr_t, uint64_t> hist;
+        uint32_t oldest = now;
+        for (uint32_t i = head - count; i != head; ++i) {
+            const sample s = samples_[i % max_samples];
+            if (s.frame < first || s.frame > now)
+                continue;
+            oldest = std::min(oldest, s.frame);
+            ++hist[s.pc];
+        }
+        for (const auto& [pc, n] : hist)
+            f(resolve(pc), n);
+        return now - oldest + (hist.empty() ? 0 : 1);
+    }
+
+    const symbol& resolve(uintptr_t pc)
+    {
+        auto& sym = pc_cache_[pc];
+        if (sym)
+            return *sym;
+#ifdef __linux__
+        Dl_info info {};
+        if (pc && dladdr(reinterpret_cast<void*>(pc), &info)) {
+            auto& func = func_cache_[reinterpret_cast<uintptr_t>(info.dli_saddr)];
+            if (!func) {
+                func = std::make_shared<symbol>();
+                if (info.dli_sname) {
+                    int status = 0;
+                    std::unique_ptr<char, decltype(&std::free)> demangled { abi::__cxa_demangle(info.dli_sname, nullptr, nullptr, &status), &std::free };
+                    func->name = status == 0 ? demangled.get() : info.dli_sname;
+                } else {
+                    const char* module = info.dli_fname ? std::strrchr(info.dli_fname, '/') : nullptr;
+                    func->name = std::string { "[" } + (module ? module + 1 : "?") + "]";
+                }
+                std::replace(func->name.begin(), func->name.end(), ';', ':');
+                func->z = classify(func->name);
+            }
+            sym = func;
+            return *sym;
+        }
+#endif
+        sym = std::make_shared<symbol>(symbol { "[unknown]", zone::other });
+        return *sym;
+    }
+
+    static zone classify(const std::string& name)
+    {
+        static const struct {
+            const char* prefix;
+            zone z;
+        } table[] = {
+            { "moira::", zone::cpu },
+            { "vamiga::CPU::", zone::cpu },
+            { "vamiga::Agnus", zone::agnus },
+            { "vamiga::Blitter", zone::agnus },
+            { "vamiga::Copper", zone::agnus },
+            { "vamiga::Sequencer", zone::agnus },
+            { "vamiga::DmaDebugger", zone::agnus },
+            { "vamiga::Denise", zone::denise },
+            { "vamiga::PixelEngine", zone::denise },
+            { "vamiga::Paula", zone::paula },
+            { "vamiga::AudioPort", zone::paula },
+            { "vamiga::AudioFilter", zone::paula },
+            { "vamiga::StateMachine", zone::paula },
+            { "vamiga::UART", zone::paula },
+            { "vamiga::DiskController", zone::disk },
+            { "vamiga::FloppyDrive", zone::disk },
+            { "vamiga::FloppyDisk", zone::disk },
+            { "vamiga::HardDrive", zone::disk },
+            { "vamiga::HdController", zone::disk },
+            { "vamiga::Memory", zone::memory },
+            { "vamiga::", zone::core },
+            { "driver::", zone::frontend },
+            { "SDL_", zone::frontend },
+        };
+        // Only the function's own qualified name counts, not its return or argument types
+        std::string qualified = name.substr(0, name.find_first_of("(<"));
+        if (const auto space = qualified.rfind(' '); space != std::string::npos)
+            qualified.erase(0, space + 1);
+        for (const auto& e : table) {
+            if (!qualified.compare(0, strlen(e.prefix), e.prefix))
+                return e.z;
+        }
+        return zone::other;
+    }
+};
+
+#endif
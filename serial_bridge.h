@@ -0,0 +1,248 @@
+#ifndef SERIAL_BRIDGE_H
+#define SERIAL_BRIDGE_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#ifndef _WIN32
+#include <cerrno>
+#include <cstdlib>
+#include <fcntl.h>
+#include <termios.h>
+#include <unistd.h>
+#endif
+
+#include "net.h"
+
+// Fixed size byte FIFO. Writers get a short count when it's full.
+class byte_ring {
+public:
+    explicit byte_ring(size_t capacity)
+        : data_(capacity)
+    {
+    }
+
+    size_t size() const
+    {
+        return size_;
+    }
+
+    bool empty() const
+    {
+        return size_ == 0;
+    }
+
+    size_t free() const
+    {
+        return data_.size() - size_;
+    }
+
+    size_t push(const void* src, size_t len)
+    {
+        len = std::min(len, free());
+        const auto p = static_cast<const uint8_t*>(src);
+        const size_t tail = (head_ + size_) % data_.size();
+        const size_t first = std::min(len, data_.size() - tail);
+        std::memcpy(&data_[tail], p, first);
+        std::memcpy(&data_[0], p + first, len - first);
+        size_ += len;
+        return len;
+    }
+
+    // Largest contiguous block at the front
+    const uint8_t* peek(size_t& len) const
+    {
+        len = std::min(size_, data_.size() - head_);
+        return &data_[head_];
+    }
+
+    void consume(size_t len)
+    {
+        len = std::min(len, size_);
+        head_ = (head_ + len) % data_.size();
+        size_ -= len;
+    }
+
+    size_t pop(void* dst, size_t len)
+    {
+        size_t done = 0;
+        while (done < len && !empty()) {
+            size_t n;
+            const uint8_t* p = peek(n);
+            n = std::min(n, len - done);
+            std::memcpy(static_cast<uint8_t*>(dst) + done, p, n);
+            consume(n);
+            done += n;
+        }
+        return done;
+    }
+
+private:
+    std::vector<uint8_t> data_;
+    size_t head_ = 0;
+    size_t size_ = 0;
+};
+
+// Bridges the emulated serial port to a loopback TCP port (one client at a time) or a pseudo terminal.
+// Both directions go through ring buffers and are moved in batches by pump(), so a fast transfer costs
+// a couple of syscalls per main loop iteration rather than anything per byte.
+class serial_bridge {
+public:
+    static constexpr size_t buffer_size = 64 * 1024;
+
+    static std::unique_ptr<serial_bridge> tcp(uint16_t port)
+    {
+        std::unique_ptr<serial_bridge> b { new serial_bridge };
+        b->listener_ = tcp_socket::listen(port);
+        std::cout << "Serial port bridged to 127.0.0.1:" << port << "\n";
+        return b;
+    }
+
+#ifndef _WIN32
+    static std::unique_ptr<serial_bridge> pty()
+    {
+        std::unique_ptr<serial_bridge> b { new serial_bridge };
+        b->pty_ = posix_openpt(O_RDWR | O_NOCTTY);
+        if (b->pty_ < 0 || grantpt(b->pty_) || unlockpt(b->pty_))
+            throw std::runtime_error { "Could not create pseudo terminal" };
+        termios t;
+        if (!tcgetattr(b->pty_, &t)) {
+            cfmakeraw(&t);
+            tcsetattr(b->pty_, TCSANOW, &t);
+        }
+        fcntl(b->pty_, F_SETFL, fcntl(b->pty_, F_GETFL) | O_NONBLOCK);
+        std::cout << "Serial port bridged to " << ptsname(b->pty_) << "\n";
+        return b;
+    }
+#endif
+
+    serial_bridge(const serial_bridge&) = delete;
+    serial_bridge& operator=(const serial_bridge&) = delete;
+
+    ~serial_bridge()
+    {
+        if (dropped_)
+            std::cerr << "Serial bridge: " << dropped_ << " bytes of output dropped\n";
+#ifndef _WIN32
+        if (pty_ >= 0)
+            ::close(pty_);
+#endif
+    }
+
+    // Data sent by the guest. Bytes that don't fit are dropped (and counted).
+    void write(const void* data, size_t len)
+    {
+        const size_t n = to_host_.push(data, len);
+        if (n != len) {
+            dropped_ += len - n;
+            if (!warned_) {
+                std::cerr << "Serial bridge: output buffer full, dropping data\n";
+                warned_ = true;
+            }
+        }
+    }
+
+    // Data received for the guest
+    size_t read(void* data, size_t len)
+    {
+        return to_guest_.pop(data, len);
+    }
+
+    size_t pending_input() const
+    {
+        return to_guest_.size();
+    }
+
+    // Non-blocking I/O in both directions
+    void pump()
+    {
+        if (listener_ && !client_) {
+            client_ = listener_.accept();
+            if (client_)
+                std::cout << "Serial bridge: client connected\n";
+        }
+
+        // Host -> guest
+        while (to_guest_.free()) {
+            uint8_t buf[4096];
+            const ptrdiff_t n = recv(buf, std::min(sizeof(buf), to_guest_.free()));
+            if (n <= 0)
+                break;
+            to_guest_.push(buf, static_cast<size_t>(n));
+        }
+
+        // Guest -> host. Without anyone listening the data is kept until the buffer overflows.
+        while (!to_host_.empty()) {
+            size_t len;
+            const uint8_t* p = to_host_.peek(len);
+            const ptrdiff_t n = send(p, len);
+            if (n <= 0)
+                break;
+            to_host_.consume(static_cast<size_t>(n));
+        }
+    }
+
+private:
+    serial_bridge()
+        : to_host_ { buffer_size }
+        , to_guest_ { buffer_size }
+    {
+    }
+
+    net_init net_init_;
+    tcp_socket listener_;
+    tcp_socket client_;
+#ifndef _WIN32
+    int pty_ = -1;
+#endif
+    byte_ring to_host_;
+    byte_ring to_guest_;
+    uint64_t dropped_ = 0;
+    bool warned_ = false;
+
+    ptrdiff_t send(const void* data, size_t len)
+    {
+#ifndef _WIN32
+        if (pty_ >= 0) {
+            const ssize_t n = ::write(pty_, data, len);
+            return n < 0 ? 0 : n;
+        }
+#endif
+        if (!client_)
+            return 0;
+        const ptrdiff_t n = client_.send(data, len);
+        if (n < 0)
+            disconnect();
+        return n;
+    }
+
+    ptrdiff_t recv(void* data, size_t len)
+    {
+#ifndef _WIN32
+        if (pty_ >= 0) {
+            // EIO just means nobody has the slave side open at the moment
+            const ssize_t n = ::read(pty_, data, len);
+            return n < 0 ? 0 : n;
+        }
+#endif
+        if (!client_)
+            return 0;
+        const ptrdiff_t n = client_.recv(data, len);
+        if (n < 0)
+            disconnect();
+        return n;
+    }
+
+    void disconnect()
+    {
+        std::cout << "Serial bridge: client disconnected\n";
+        client_.close();
+    }
+};
+
+#endif
@@ -0,0 +1,383 @@
+#ifndef STREAM_H
+#define STREAM_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "net.h"
+
+// Frame/audio streaming over loopback TCP, shared by the emulator (server) and stream_client.
+//
+// Every message is an 8 byte header (type, payload length; both little endian u32) and the payload.
+// Server to client:
+//   'HELO' u16 width, u16 height, u16 tile size, u16 0, u32 sample rate
+//   'FRAM' u32 frame, u16 tile count, u16 flags (1 = key frame), then per tile:
+//          u16 tile x, u16 tile y, u32 length, RLE data (see rle_encode)
+//   'AUDI' Interleaved stereo s16 samples. Silence isn't sent.
+// Client to server:
+//   'KEY ' u8 Amiga keycode (0-127), u8 pressed
+//   'MOUS' s16 dx, s16 dy, u8 buttons (bit 0 left, bit 1 right)
+//   'JOY ' u8 state (bit 0 up, 1 down, 2 left, 3 right, 4 fire)
+// Frames are single fields of the visible area, tiles are only sent when they differ from the previous field.
+namespace stream {
+
+constexpr int tile_size = 32;
+
+constexpr uint32_t fourcc(const char (&s)[5])
+{
+    return static_cast<uint8_t>(s[0]) | static_cast<uint8_t>(s[1]) << 8 | static_cast<uint8_t>(s[2]) << 16 | static_cast<uint32_t>(static_cast<uint8_t>(s[3])) << 24;
+}
+
+constexpr uint32_t msg_hello = fourcc("HELO");
+constexpr uint32_t msg_frame = fourcc("FRAM");
+constexpr uint32_t msg_audio = fourcc("AUDI");
+constexpr uint32_t msg_key = fourcc("KEY ");
+constexpr uint32_t msg_mouse = fourcc("MOUS");
+constexpr uint32_t msg_joystick = fourcc("JOY ");
+
+constexpr uint32_t max_payload = 16 << 20;
+
+inline void put16(std::string& s, uint16_t v)
+{
+    s.push_back(static_cast<char>(v));
+    s.push_back(static_cast<char>(v >> 8));
+}
+
+inline void put32(std::string& s, uint32_t v)
+{
+    put16(s, static_cast<uint16_t>(v));
+    put16(s, static_cast<uint16_t>(v >> 16));
+}
+
+inline uint16_t get16(const uint8_t* p)
+{
+    return static_cast<uint16_t>(p[0] | p[1] << 8);
+}
+
+inline uint32_t get32(const uint8_t* p)
+{
+    return get16(p) | static_cast<uint32_t>(get16(p + 2)) << 16;
+}
+
+inline void put_message(std::string& out, uint32_t type, const std::string& payload)
+{
+    put32(out, type);
+    put32(out, static_cast<uint32_t>(payload.size()));
+    out += payload;
+}
+
+// Splits complete messages off the front of buf, returns false on a malformed stream
+template <typename F>
+bool parse_messages(std::string& buf, F on_message)
+{
+    size_t pos = 0;
+    while (buf.size() - pos >= 8) {
+        const auto p = reinterpret_cast<const uint8_t*>(buf.data() + pos);
+        const uint32_t len = get32(p + 4);
+        if (len > max_payload)
+            return false;
+        if (buf.size() - pos - 8 < len)
+            break;
+        on_message(get32(p), p + 8, len);
+        pos += 8 + len;
+    }
+    buf.erase(0, pos);
+    return true;
+}
+
+// PackBits style RLE of 24-bit pixels (the alpha byte is dropped). A control byte c < 128 is followed by
+// c + 1 literal pixels, c >= 128 by one pixel repeated c - 126 times.
+inline void rle_encode(std::string& out, const uint32_t* src, int width, int height, int stride)
+{
+    const auto put_pixel = [&](uint32_t c) {
+        out.push_back(static_cast<char>(c));
+        out.push_back(static_cast<char>(c >> 8));
+        out.push_back(static_cast<char>(c >> 16));
+    };
+    for (int y = 0; y < height; ++y, src += stride) {
+        for (int x = 0; x < width;) {
+            const uint32_t c = src[x] & 0xffffff;
+            int run = 1;
+            while (x + run < width && run < 129 && (src[x + run] & 0xffffff) == c)
+                ++run;
+            if (run >= 2) {
+                out.push_back(static_cast<char>(126 + run));
+                put_pixel(c);
+                x += run;
+                continue;
+            }
+            int lit = 1;
+            while (x + lit < width && lit < 128 && (x + lit + 1 >= width || (src[x + lit] & 0xffffff) != (src[x + lit + 1] & 0xffffff)))
+                ++lit;
+            out.push_back(static_cast<char>(lit - 1));
+            for (int i = 0; i < lit; ++i)
+                put_pixel(src[x + i]);
+            x += lit;
+        }
+    }
+}
+
+// Returns false if the data doesn't decode to exactly width x height pixels
+inline bool rle_decode(uint32_t* dst, int width, int height, int stride, const uint8_t* p, size_t len)
+{
+    const uint8_t* const end = p + len;
+    const auto get_pixel = [&](const uint8_t* q) { return 0xff000000 | q[0] | q[1] << 8 | q[2] << 16; };
+    for (int y = 0; y < height; ++y, dst += stride) {
+        for (int x = 0; x < width;) {
+            if (p == end)
+                return false;
+            const int c = *p++;
+            const int n = c < 128 ? c + 1 : c - 126;
+            const int bytes = c < 128 ? 3 * n : 3;
+            if (x + n > width || end - p < bytes)
+                return false;
+            for (int i = 0; i < n; ++i)
+                dst[x + i] = get_pixel(c < 128 ? p + 3 * i : p);
+            p += bytes;
+            x += n;
+        }
+    }
+    return p == end;
+}
+
+struct input_event {
+    uint32_t type;
+    int16_t dx, dy;
+    uint8_t code;
+    uint8_t value;
+};
+
+// Streams to any number of loopback clients. Encoding is shared; a client that connects, or that fell so far
+// behind that frames had to be skipped for it, gets a key frame next.
+class server {
+public:
+    static constexpr size_t max_backlog = 4 << 20;
+
+    server(uint16_t port, int width, int height, int sample_rate)
+        : listener_ { tcp_socket::listen(port) }
+        , width_ { width }
+        , height_ { height }
+        , sample_rate_ { sample_rate }
+    {
+        std::cout << "Streaming on 127.0.0.1:" << port << "\n";
+    }
+
+    bool has_clients() const
+    {
+        return !clients_.empty();
+    }
+
+    // cur and prev are the current and previous field, positioned at the top left of the visible area
+    void send_frame(uint32_t nr, const uint32_t* cur, const uint32_t* prev, int stride)
+    {
+        if (clients_.empty())
+            return;
+
+        bool need_key = false, need_delta = false;
+        for (auto& c : clients_) {
+            c.skipped = c.out.size() > max_backlog;
+            if (c.skipped)
+                c.key_frame = true;
+            else if (c.key_frame)
+                need_key = true;
+            else
+                need_delta = true;
+        }
+
+        std::string key, delta;
+        if (need_key)
+            key = encode(nr, cur, nullptr, stride);
+        if (need_delta)
+            delta = encode(nr, cur, prev, stride);
+
+        for (auto& c : clients_) {
+            if (c.skipped)
+                continue;
+            if (c.key_frame) {
+                c.out += key;
+                c.key_frame = false;
+            } else if (!delta.empty()) {
+                c.out += delta;
+            }
+        }
+    }
+
+    // Key frame for clients still waiting for one, e.g. ones that connected while the emulator is paused
+    void send_key_frame(uint32_t nr, const uint32_t* cur, int stride)
+    {
+        if (std::none_of(clients_.begin(), clients_.end(), [](const client& c) { return c.key_frame && c.out.size() <= max_backlog; }))
+            return;
+        const std::string key = encode(nr, cur, nullptr, stride);
+        for (auto& c : clients_) {
+            if (c.key_frame && c.out.size() <= max_backlog) {
+                c.out += key;
+                c.key_frame = false;
+            }
+        }
+    }
+
+    // Interleaved stereo
+    void send_audio(const float* samples, size_t frames)
+    {
+        if (clients_.empty() || !frames)
+            return;
+        if (std::all_of(samples, samples + 2 * frames, [](float f) { return f == 0.0f; }))
+            return;
+        std::string payload;
+        payload.reserve(4 * frames);
+        for (size_t i = 0; i < 2 * frames; ++i)
+            put16(payload, static_cast<uint16_t>(static_cast<int16_t>(std::clamp(samples[i], -1.0f, 1.0f) * 32767.0f)));
+        std::string msg;
+        put_message(msg, msg_audio, payload);
+        for (auto& c : clients_) {
+            if (c.out.size() <= max_backlog)
+                c.out += msg;
+        }
+    }
+
+    // Accepts new clients, flushes pending output and collects input from the clients
+    void pump(std::vector<input_event>& events)
+    {
+        for (tcp_socket s; (s = listener_.accept());) {
+            std::cout << "Stream: client connected\n";
+            client c;
+            c.s = std::move(s);
+            std::string hello;
+            put16(hello, static_cast<uint16_t>(width_));
+            put16(hello, static_cast<uint16_t>(height_));
+            put16(hello, tile_size);
+            put16(hello, 0);
+            put32(hello, static_cast<uint32_t>(sample_rate_));
+            put_message(c.out, msg_hello, hello);
+            clients_.push_back(std::move(c));
+        }
+
+        for (auto& c : clients_) {
+            while (c.sent < c.out.size()) {
+                const ptrdiff_t n = c.s.send(c.out.data() + c.sent, c.out.size() - c.sent);
+                if (n <= 0) {
+                    c.dead = n < 0;
+                    break;
+                }
+                c.sent += n;
+            }
+            if (c.sent == c.out.size()) {
+                c.out.clear();
+                c.sent = 0;
+            } else if (c.sent > (1 << 20)) {
+                c.out.erase(0, c.sent);
+                c.sent = 0;
+            }
+
+            char buf[1024];
+            for (ptrdiff_t n; !c.dead && (n = c.s.recv(buf, sizeof(buf))) != 0;) {
+                if (n < 0) {
+                    c.dead = true;
+                    break;
+                }
+                c.in.append(buf, n);
+            }
+            bool valid = true;
+            if (!parse_messages(c.in, [&](uint32_t type, const uint8_t* p, uint32_t len) { valid = valid && parse_input(events, type, p, len); }) || !valid)
+                c.dead = true;
+        }
+
+        const auto before = clients_.size();
+        clients_.erase(std::remove_if(clients_.begin(), clients_.end(), [](const client& c) { return c.dead; }), clients_.end());
+        if (clients_.size() != before)
+            std::cout << "Stream: client disconnected\n";
+    }
+
+private:
+    struct client {
+        tcp_socket s;
+        std::string out;
+        size_t sent = 0;
+        std::string in;
+        bool key_frame = true;
+        bool skipped = false;
+        bool dead = false;
+    };
+
+    net_init net_init_;
+    tcp_socket listener_;
+    const int width_;
+    const int height_;
+    const int sample_rate_;
+    std::vector<client> clients_;
+
+    // Returns an empty string if prev is given and nothing changed
+    std::string encode(uint32_t nr, const uint32_t* cur, const uint32_t* prev, int stride) const
+    {
+        std::string tiles;
+        uint16_t count = 0;
+        for (int ty = 0; ty * tile_size < height_; ++ty) {
+            const int h = std::min(tile_size, height_ - ty * tile_size);
+            for (int tx = 0; tx * tile_size < width_; ++tx) {
+                const int w = std::min(tile_size, width_ - tx * tile_size);
+                const size_t offset = static_cast<size_t>(ty) * tile_size * stride + tx * tile_size;
+                if (prev && !tile_differs(cur + offset, prev + offset, w, h, stride))
+                    continue;
+                put16(tiles, static_cast<uint16_t>(tx));
+                put16(tiles, static_cast<uint16_t>(ty));
+                const size_t len_pos = tiles.size();
+                put32(tiles, 0);
+                rle_encode(tiles, cur + offset, w, h, stride);
+                const uint32_t len = static_cast<uint32_t>(tiles.size() - len_pos - 4);
+                for (int i = 0; i < 4; ++i)
+                    tiles[len_pos + i] = static_cast<char>(len >> (8 * i));
+                ++count;
+            }
+        }
+        if (prev && !count)
+            return {};
+
+        std::string payload;
+        put32(payload, nr);
+        put16(payload, count);
+        put16(payload, prev ? 0 : 1);
+        payload += tiles;
+        std::string msg;
+        put_message(msg, msg_frame, payload);
+        return msg;
+    }
+
+    static bool tile_differs(const uint32_t* a, const uint32_t* b, int w, int h, int stride)
+    {
+        for (int y = 0; y < h; ++y, a += stride, b += stride) {
+            if (std::memcmp(a, b, w * sizeof(uint32_t)))
+                return true;
+        }
+        return false;
+    }
+
+    // Returns false for a malformed message
+    static bool parse_input(std::vector<input_event>& events, uint32_t type, const uint8_t* p, uint32_t len)
+    {
+        input_event e { type, 0, 0, 0, 0 };
+        if (type == msg_key && len >= 2) {
+            if (p[0] >= 0x80) // Amiga key codes are 7 bits
+                return false;
+            e.code = p[0];
+            e.value = p[1];
+        } else if (type == msg_mouse && len >= 5) {
+            e.dx = static_cast<int16_t>(get16(p));
+            e.dy = static_cast<int16_t>(get16(p + 2));
+            e.value = p[4];
+        } else if (type == msg_joystick && len >= 1) {
+            e.value = p[0];
+        } else {
+            return true; // Unknown messages are skipped
+        }
+        events.push_back(e);
+        return true;
+    }
+};
+
+} // namespace stream
+
+#endif
@@ -0,0 +1,293 @@
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <SDL.h>
+#undef main // SDL2...
+
+#include "keymap.h"
+#include "stream.h"
+
+// Reference client for -stream: shows the frames, plays the audio and sends keyboard, mouse and joystick
+// (keypad) input back. Click the window to capture the mouse, F12 releases it.
+
+[[noreturn]] void throw_sdl_error(const std::string& what)
+{
+    throw std::runtime_error { what + " failed: " + SDL_GetError() };
+}
+
+class client {
+public:
+    client(const std::string& host, uint16_t port)
+        : s_ { tcp_socket::connect(host, port) }
+    {
+        if (SDL_Init(SDL_INIT_VIDEO | SDL_INIT_AUDIO))
+            throw_sdl_error("SDL_Init");
+    }
+
+    client(const client&) = delete;
+    client& operator=(const client&) = delete;
+
+    ~client()
+    {
+        if (dev_)
+            SDL_CloseAudioDevice(dev_);
+        if (texture_)
+            SDL_DestroyTexture(texture_);
+        if (renderer_)
+            SDL_DestroyRenderer(renderer_);
+        if (window_)
+            SDL_DestroyWindow(window_);
+        SDL_Quit();
+    }
+
+    int run()
+    {
+        for (;;) {
+            SDL_Event e;
+            for (bool have_event = SDL_WaitEventTimeout(&e, 5); have_event; have_event = SDL_PollEvent(&e)) {
+                if (!handle_event(e))
+                    return 0;
+            }
+            if (mouse_dx_ || mouse_dy_) {
+                send_mouse();
+                mouse_dx_ = mouse_dy_ = 0;
+            }
+
+            while (sent_ < out_.size()) {
+                const ptrdiff_t n = s_.send(out_.data() + sent_, out_.size() - sent_);
+                if (n < 0)
+                    throw std::runtime_error { "Connection lost" };
+                if (!n)
+                    break;
+                sent_ += n;
+            }
+            if (sent_ == out_.size()) {
+                out_.clear();
+                sent_ = 0;
+            }
+
+            char buf[65536];
+            for (ptrdiff_t n; (n = s_.recv(buf, sizeof(buf))) != 0;) {
+                if (n < 0) {
+                    std::cout << "Server closed the connection\n";
+                    return 0;
+                }
+                in_.append(buf, n);
+            }
+            if (!stream::parse_messages(in_, [this](uint32_t type, const uint8_t* p, uint32_t len) { handle_message(type, p, len); }))
+                throw std::runtime_error { "Malformed stream" };
+
+            if (dirty_) {
+                SDL_RenderCopy(renderer_, texture_, nullptr, nullptr);
+                SDL_RenderPresent(renderer_);
+                dirty_ = false;
+            }
+        }
+    }
+
+private:
+    tcp_socket s_;
+    SDL_Window* window_ = nullptr;
+    SDL_Renderer* renderer_ = nullptr;
+    SDL_Texture* texture_ = nullptr;
+    SDL_AudioDeviceID dev_ = 0;
+    int width_ = 0;
+    int height_ = 0;
+    int tile_size_ = 0;
+    int sample_rate_ = 0;
+    std::vector<uint32_t> tile_;
+    std::string in_;
+    std::string out_;
+    size_t sent_ = 0;
+    bool dirty_ = false;
+    bool mouse_captured_ = false;
+    int mouse_dx_ = 0;
+    int mouse_dy_ = 0;
+    uint8_t mouse_buttons_ = 0;
+    uint8_t joystick_ = 0;
+
+    void handle_message(uint32_t type, const uint8_t* p, uint32_t len)
+    {
+        if (type == stream::msg_hello && len >= 12) {
+            open(stream::get16(p), stream::get16(p + 2), stream::get16(p + 4), static_cast<int>(stream::get32(p + 8)));
+        } else if (type == stream::msg_frame && len >= 8 && texture_) {
+            const uint32_t count = stream::get16(p + 4);
+            const uint8_t* end = p + len;
+            p += 8;
+            for (uint32_t i = 0; i < count; ++i) {
+                if (end - p < 8)
+                    throw std::runtime_error { "Truncated frame" };
+                const int tx = stream::get16(p);
+                const int ty = stream::get16(p + 2);
+                const uint32_t size = stream::get32(p + 4);
+                p += 8;
+                if (static_cast<size_t>(end - p) < size)
+                    throw std::runtime_error { "Truncated frame" };
+                const SDL_Rect r { tx * tile_size_, ty * tile_size_, std::min(tile_size_, width_ - tx * tile_size_), std::min(tile_size_, height_ - ty * tile_size_) };
+                if (r.w <= 0 || r.h <= 0 || !stream::rle_decode(tile_.data(), r.w, r.h, tile_size_, p, size))
+                    throw std::runtime_error { "Invalid tile" };
+                SDL_UpdateTexture(texture_, &r, tile_.data(), tile_size_ * sizeof(uint32_t));
+                p += size;
+            }
+            dirty_ = true;
+        } else if (type == stream::msg_audio && dev_) {
+            // Don't let latency build up if playback is slower than the emulator (limit is 1/4 s at 4 bytes per sample)
+            if (SDL_GetQueuedAudioSize(dev_) > static_cast<uint32_t>(sample_rate_))
+                SDL_ClearQueuedAudio(dev_);
+            SDL_QueueAudio(dev_, p, len & ~3U);
+        }
+    }
+
+    void open(int width, int height, int tile_size, int sample_rate)
+    {
+        if (window_)
+            throw std::runtime_error { "Unexpected hello" };
+        width_ = width;
+        height_ = height;
+        tile_size_ = tile_size;
+        sample_rate_ = sample_rate;
+        tile_.resize(static_cast<size_t>(tile_size) * tile_size);
+        std::cout << "Stream: " << width << "x" << height << ", " << sample_rate << " Hz\n";
+
+        // Each field is shown at double height
+        window_ = SDL_CreateWindow("vAmiga stream", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED, width, 2 * height, SDL_WINDOW_SHOWN);
+        if (!window_)
+            throw_sdl_error("SDL_CreateWindow");
+        renderer_ = SDL_CreateRenderer(window_, -1, SDL_RENDERER_ACCELERATED);
+        if (!renderer_)
+            throw_sdl_error("SDL_CreateRenderer");
+        texture_ = SDL_CreateTexture(renderer_, SDL_PIXELFORMAT_RGBA32, SDL_TEXTUREACCESS_STATIC, width, height);
+        if (!texture_)
+            throw_sdl_error("SDL_CreateTexture");
+
+        SDL_AudioSpec want {};
+        want.freq = sample_rate;
+        want.format = AUDIO_S16LSB;
+        want.channels = 2;
+        want.samples = 1024;
+        dev_ = SDL_OpenAudioDevice(nullptr, 0, &want, nullptr, 0);
+        if (!dev_)
+            std::cerr << "SDL_OpenAudioDevice failed: " << SDL_GetError() << " (no sound)\n";
+        else
+            SDL_PauseAudioDevice(dev_, false);
+    }
+
+    void send(uint32_t type, const std::string& payload)
+    {
+        stream::put_message(out_, type, payload);
+    }
+
+    void send_mouse()
+    {
+        std::string payload;
+        stream::put16(payload, static_cast<uint16_t>(std::clamp(mouse_dx_, -32768, 32767)));
+        stream::put16(payload, static_cast<uint16_t>(std::clamp(mouse_dy_, -32768, 32767)));
+        payload.push_back(static_cast<char>(mouse_buttons_));
+        send(stream::msg_mouse, payload);
+    }
+
+    void capture_mouse(bool enabled)
+    {
+        if (enabled == mouse_captured_)
+            return;
+        SDL_SetRelativeMouseMode(enabled ? SDL_TRUE : SDL_FALSE);
+        mouse_captured_ = enabled;
+        if (!enabled && mouse_buttons_) {
+            mouse_buttons_ = 0;
+            send_mouse();
+        }
+    }
+
+    // Same keypad layout as the emulator, bits as in the 'JOY ' message
+    static uint8_t joystick_bit(SDL_Keycode key)
+    {
+        switch (key) {
+        case SDLK_KP_8: return 1 << 0;
+        case SDLK_KP_2: return 1 << 1;
+        case SDLK_KP_4: return 1 << 2;
+        case SDLK_KP_6: return 1 << 3;
+        case SDLK_KP_0:
+        case SDLK_KP_5: return 1 << 4;
+        default: return 0;
+        }
+    }
+
+    bool handle_event(const SDL_Event& e)
+    {
+        switch (e.type) {
+        case SDL_QUIT:
+            return false;
+        case SDL_KEYDOWN:
+        case SDL_KEYUP: {
+            if (e.key.repeat)
+                break;
+            const bool down = e.type == SDL_KEYDOWN;
+            if (e.key.keysym.sym == SDLK_F12) {
+                capture_mouse(false);
+                break;
+            }
+            if (const uint8_t bit = joystick_bit(e.key.keysym.sym)) {
+                joystick_ = down ? joystick_ | bit : joystick_ & ~bit;
+                send(stream::msg_joystick, std::string(1, static_cast<char>(joystick_)));
+                break;
+            }
+            if (const auto key = convert_key(e.key.keysym.sym); key != 0xFF) {
+                std::string payload;
+                payload.push_back(static_cast<char>(key));
+                payload.push_back(down);
+                send(stream::msg_key, payload);
+            }
+            break;
+        }
+        case SDL_MOUSEBUTTONDOWN:
+        case SDL_MOUSEBUTTONUP:
+            if (e.button.button != SDL_BUTTON_LEFT && e.button.button != SDL_BUTTON_RIGHT)
+                break;
+            if (!mouse_captured_) {
+                if (e.type == SDL_MOUSEBUTTONDOWN)
+                    capture_mouse(true);
+                break;
+            } else {
+                const uint8_t bit = e.button.button == SDL_BUTTON_LEFT ? 1 : 2;
+                mouse_buttons_ = e.type == SDL_MOUSEBUTTONDOWN ? mouse_buttons_ | bit : mouse_buttons_ & ~bit;
+                send_mouse(); // Includes any motion so far, keeping the order
+                mouse_dx_ = mouse_dy_ = 0;
+            }
+            break;
+        case SDL_MOUSEMOTION:
+            if (mouse_captured_) {
+                mouse_dx_ += e.motion.xrel;
+                mouse_dy_ += e.motion.yrel;
+            }
+            break;
+        case SDL_WINDOWEVENT:
+            if (e.window.event == SDL_WINDOWEVENT_FOCUS_LOST)
+                capture_mouse(false);
+            else if (e.window.event == SDL_WINDOWEVENT_EXPOSED)
+                dirty_ = true;
+            break;
+        }
+        return true;
+    }
+};
+
+int main(int argc, char* argv[])
+{
+    if (argc < 2) {
+        std::cerr << "Usage: " << argv[0] << " port [host]\n";
+        return 1;
+    }
+    try {
+        net_init net;
+        client c { argc > 2 ? argv[2] : "127.0.0.1", parse_port(argv[1]) };
+        return c.run();
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << "\n";
+        return 1;
+    }
+}